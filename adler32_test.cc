@@ -0,0 +1,141 @@
+// Checks that the Adler-32 paths of lodepng agree with the definition: the
+// scalar loop, SSSE3 and AVX2, on random buffers at every alignment and on
+// lengths around the blocks they reduce modulo 65521 after, from random
+// starting checksums, and that lodepng_adler32_combine joins the checksums
+// of the two parts of a buffer split anywhere. Built from lodepng.cpp itself
+// to reach its static functions.
+
+#include <stdio.h>
+
+#include <random>
+#include <vector>
+
+#include "lodepng.cpp"
+
+namespace {
+
+const unsigned BASE = 65521;
+const size_t MAX_OFFSET = 32;
+
+int failures = 0;
+size_t checks = 0;
+
+void expect(unsigned expected, unsigned actual, const char *what,
+            size_t offset, size_t length) {
+  ++checks;
+  if (expected == actual) return;
+  if (++failures <= 20) {
+    fprintf(stderr, "%s: offset %zu length %zu: expected %08x, got %08x\n",
+            what, offset, length, expected, actual);
+  }
+}
+
+/** Adler-32 continuing from adler, reducing after every byte. */
+unsigned reference(unsigned adler, const unsigned char *data, size_t length) {
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = adler >> 16;
+  for (size_t i = 0; i < length; ++i) {
+    s1 = (s1 + data[i]) % BASE;
+    s2 = (s2 + s1) % BASE;
+  }
+  return s2 << 16 | s1;
+}
+
+/** Lengths up to a few KB, and around the runs of 5552 and 173 * 32 bytes. */
+std::vector<size_t> lengths(std::mt19937 *random) {
+  std::vector<size_t> result;
+  for (size_t length = 0; length <= 300; ++length) result.push_back(length);
+  for (int i = 0; i < 100; ++i) result.push_back((*random)() % 8192);
+  for (size_t run : {5552, 173 * 32}) {
+    for (size_t k = 1; k <= 4; ++k) {
+      for (int delta = -33; delta <= 33; delta += 3) {
+        result.push_back(k * run + delta);
+      }
+    }
+  }
+  return result;
+}
+
+void checkUpdate(std::mt19937 *random, const std::vector<unsigned char> &buffer,
+                 const char *kind) {
+  for (size_t length : lengths(random)) {
+    for (size_t offset = 0; offset < MAX_OFFSET; offset += 1 + offset / 4) {
+      const unsigned char *data = &buffer[offset];
+      // From the initial checksum, and from a random valid one
+      const unsigned adler =
+          offset % 2 ? 1 : ((*random)() % BASE) << 16 | (*random)() % BASE;
+      const unsigned expected = reference(adler, data, length);
+      expect(expected, update_adler32_scalar(adler, data, length), kind,
+             offset, length);
+      expect(expected, update_adler32(adler, data, length), kind, offset,
+             length);
+      expect(expected, lodepng_update_adler32(adler, data, length), kind,
+             offset, length);
+#ifdef LODEPNG_ADLER32_SIMD
+      if (__builtin_cpu_supports("ssse3")) {
+        expect(expected, update_adler32_ssse3(adler, data, length), kind,
+               offset, length);
+      }
+      if (__builtin_cpu_supports("avx2")) {
+        expect(expected, update_adler32_avx2(adler, data, length), kind,
+               offset, length);
+      }
+#endif
+    }
+  }
+}
+
+void checkCombine(std::mt19937 *random,
+                  const std::vector<unsigned char> &buffer) {
+  for (size_t length : lengths(random)) {
+    const unsigned char *data = buffer.data();
+    const unsigned whole = reference(1, data, length);
+    std::vector<size_t> splits = {0, length};
+    for (int i = 0; i < 8 && length; ++i) {
+      splits.push_back((*random)() % (length + 1));
+    }
+    for (size_t split : splits) {
+      expect(whole,
+             lodepng_adler32_combine(reference(1, data, split),
+                                     reference(1, data + split, length - split),
+                                     length - split),
+             "lodepng_adler32_combine", split, length);
+    }
+  }
+  // Second parts longer than the modulus, a multiple of it and one more
+  for (size_t second : {size_t(BASE) - 1, size_t(BASE), size_t(BASE) + 1,
+                        size_t(3) * BASE, size_t(200000)}) {
+    std::vector<unsigned char> big(1000 + second);
+    for (unsigned char &byte : big) byte = (*random)();
+    expect(reference(1, big.data(), big.size()),
+           lodepng_adler32_combine(reference(1, big.data(), 1000),
+                                   reference(1, &big[1000], second), second),
+           "lodepng_adler32_combine", 1000, big.size());
+  }
+}
+
+}  // namespace
+
+int main() {
+#ifdef LODEPNG_ADLER32_SIMD
+  printf("SSSE3 %s, AVX2 %s\n",
+         __builtin_cpu_supports("ssse3") ? "tested" : "not supported here",
+         __builtin_cpu_supports("avx2") ? "tested" : "not supported here");
+#else
+  printf("No SIMD Adler-32 on this target: only the scalar path tested\n");
+#endif
+  std::mt19937 random(20240601);
+  const size_t size = 4 * 5552 + 64 + MAX_OFFSET;
+  std::vector<unsigned char> buffer(size);
+  for (unsigned char &byte : buffer) byte = random();
+  checkUpdate(&random, buffer, "random bytes");
+  // All 0xff makes the sums largest before each reduction
+  checkUpdate(&random, std::vector<unsigned char>(size, 0xff), "0xff bytes");
+  checkCombine(&random, buffer);
+  if (failures) {
+    fprintf(stderr, "%d of %zu Adler-32 checks failed\n", failures, checks);
+    return 1;
+  }
+  printf("%zu Adler-32 checks passed\n", checks);
+  return 0;
+}
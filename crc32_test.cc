@@ -0,0 +1,93 @@
+// Checks that the CRC-32 paths of lodepng agree: the bytewise table, slicing
+// by 8 and PCLMULQDQ folding, over random buffers of every length up to a few
+// KB at every alignment, and split anywhere between PCLMULQDQ and slicing.
+// Built from lodepng.cpp itself to reach its static functions.
+
+#include <stdio.h>
+
+#include <random>
+#include <vector>
+
+#include "lodepng.cpp"
+
+namespace {
+
+const int MAX_LENGTH = 4096;
+const int MAX_OFFSET = 16;
+
+int failures = 0;
+
+void expect(unsigned expected, unsigned actual, const char *what,
+            size_t offset, size_t length, size_t split) {
+  if (expected == actual) return;
+  if (++failures <= 20) {
+    fprintf(stderr,
+            "%s: offset %zu length %zu split %zu: expected %08x, got %08x\n",
+            what, offset, length, split, expected, actual);
+  }
+}
+
+/** The CRC of data by the bytewise table alone, the reference. */
+unsigned bytewise(const unsigned char *data, size_t length) {
+  return crc32_bytewise(0xffffffffu, data, length) ^ 0xffffffffu;
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 random(20240601);
+  std::vector<unsigned char> buffer(MAX_LENGTH + MAX_OFFSET);
+  for (unsigned char &byte : buffer) byte = random();
+
+#ifdef LODEPNG_CRC32_PCLMUL
+  const bool pclmul = __builtin_cpu_supports("pclmul");
+#else
+  const bool pclmul = false;
+#endif
+  if (!pclmul) printf("PCLMULQDQ not supported here: not tested\n");
+
+  size_t checks = 0;
+  for (size_t length = 0; length <= MAX_LENGTH;
+       length += length < 1024 ? 1 : 61) {
+    for (size_t offset = 0; offset < MAX_OFFSET; ++offset) {
+      const unsigned char *data = &buffer[offset];
+      const unsigned expected = bytewise(data, length);
+
+      expect(expected, crc32_slice8(0xffffffffu, data, length) ^ 0xffffffffu,
+             "slice8", offset, length, 0);
+      expect(expected, lodepng_crc32(data, length), "lodepng_crc32", offset,
+             length, 0);
+      ++checks;
+
+      // Slicing continues the CRC of any prefix, whether bytewise or sliced
+      for (size_t split = 1; split < length && split < 24; ++split) {
+        const unsigned r = crc32_bytewise(0xffffffffu, data, split);
+        expect(expected,
+               crc32_slice8(r, data + split, length - split) ^ 0xffffffffu,
+               "bytewise then slice8", offset, length, split);
+        ++checks;
+      }
+
+#ifdef LODEPNG_CRC32_PCLMUL
+      // PCLMULQDQ takes any prefix of at least 64 bytes in whole 16-byte
+      // blocks, slicing the rest: lodepng_crc32 splits at length & ~15.
+      if (!pclmul) continue;
+      for (size_t split = 64; split <= length; split += 16) {
+        if (length > 1024 && split + 64 < length && split % 256 != 0) continue;
+        const unsigned r = crc32_pclmul(0xffffffffu, data, split);
+        expect(expected,
+               crc32_slice8(r, data + split, length - split) ^ 0xffffffffu,
+               "pclmul then slice8", offset, length, split);
+        ++checks;
+      }
+#endif
+    }
+  }
+
+  if (failures) {
+    fprintf(stderr, "%d of %zu CRC checks failed\n", failures, checks);
+    return 1;
+  }
+  printf("%zu CRC checks passed\n", checks);
+  return 0;
+}
@@ -0,0 +1,262 @@
+// Checks that the SSE2 and AVX2 PNG filters and LFS_MINSUM sums of lodepng
+// are byte-exact with the scalar definitions, for every filter type and the
+// bytewidths of 8- and 16-bit grey, RGB and RGBA, with and without a
+// previous line, at lengths around the 16- and 32-byte vector loops, and
+// that LFS_MINSUM picks the same filter type for every row. Built from
+// lodepng.cpp itself to reach its static functions.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <random>
+#include <vector>
+
+#include "lodepng.cpp"
+
+namespace {
+
+int failures = 0;
+size_t checks = 0;
+
+void expect(bool ok, const char *what, size_t bytewidth, size_t length,
+            bool prev, int type) {
+  ++checks;
+  if (ok) return;
+  if (++failures <= 20) {
+    fprintf(stderr, "%s: bytewidth %zu length %zu %s previous line type %d\n",
+            what, bytewidth, length, prev ? "with" : "without", type);
+  }
+}
+
+int paeth(int a, int b, int c) {
+  const int pa = abs(b - c);
+  const int pb = abs(a - c);
+  const int pc = abs(a + b - 2 * c);
+  if (pa <= pb && pa <= pc) return a;
+  return pb <= pc ? b : c;
+}
+
+/** The filter of the PNG specification, one byte at a time. */
+void scalarFilter(unsigned char *out, const unsigned char *scanline,
+                  const unsigned char *prevline, size_t length,
+                  size_t bytewidth, int type) {
+  for (size_t i = 0; i < length; ++i) {
+    const int a = i >= bytewidth ? scanline[i - bytewidth] : 0;
+    const int b = prevline ? prevline[i] : 0;
+    const int c = prevline && i >= bytewidth ? prevline[i - bytewidth] : 0;
+    const int predictor[] = {0, a, b, (a + b) >> 1, paeth(a, b, c)};
+    out[i] = scanline[i] - predictor[type];
+  }
+}
+
+/** The LFS_MINSUM score of a filtered scanline, one byte at a time. */
+size_t scalarSum(const unsigned char *filtered, size_t length, int type) {
+  size_t sum = 0;
+  for (size_t i = 0; i < length; ++i) {
+    sum += type == 0 || filtered[i] < 128 ? filtered[i] : 255 - filtered[i];
+  }
+  return sum;
+}
+
+/**
+ * Random bytes, or for smooth a random walk from byte to byte of a channel,
+ * the kind of scanline that makes the filters other than None win.
+ */
+void fill(std::mt19937 *random, bool smooth, size_t bytewidth,
+          std::vector<unsigned char> *line) {
+  for (size_t i = 0; i < line->size(); ++i) {
+    (*line)[i] = !smooth || i < bytewidth
+                     ? (*random)()
+                     : (*line)[i - bytewidth] + int((*random)() % 7) - 3;
+  }
+}
+
+const size_t BYTEWIDTHS[] = {1, 3, 4, 6, 8};
+
+#ifdef LODEPNG_FILTER_SIMD
+bool supported(bool avx2) {
+  return avx2 ? __builtin_cpu_supports("avx2")
+              : __builtin_cpu_supports("sse2");
+}
+#endif
+
+/** The kernels and their dispatch on single scanlines. */
+void checkScanlines(std::mt19937 *random) {
+  std::vector<size_t> lengths;
+  for (size_t length = 1; length <= 80; ++length) lengths.push_back(length);
+  for (size_t length : {95, 96, 97, 127, 128, 129, 255, 256, 257, 1000}) {
+    lengths.push_back(length);
+  }
+  for (size_t bytewidth : BYTEWIDTHS) {
+    for (size_t length : lengths) {
+      if (length < bytewidth) continue;
+      std::vector<unsigned char> scanline(length), prevline(length);
+      std::vector<unsigned char> expected(length), actual(length);
+      for (bool smooth : {false, true}) {
+        fill(random, smooth, bytewidth, &scanline);
+        fill(random, smooth, bytewidth, &prevline);
+        for (bool prev : {false, true}) {
+          const unsigned char *p = prev ? prevline.data() : nullptr;
+          for (int type = 0; type < 5; ++type) {
+            scalarFilter(expected.data(), scanline.data(), p, length,
+                         bytewidth, type);
+            actual.assign(length, 0xAA);
+            filterScanline(actual.data(), scanline.data(), p, length,
+                           bytewidth, type);
+            expect(actual == expected, "filterScanline", bytewidth, length,
+                   prev, type);
+            expect(filterSum(actual.data(), length, type) ==
+                       scalarSum(expected.data(), length, type),
+                   "filterSum", bytewidth, length, prev, type);
+#ifdef LODEPNG_FILTER_SIMD
+            // The kernels alone, the scalar code finishing what they leave.
+            // Without a previous line they only ever do Sub.
+            if (type == 0 || (!prev && type != 1)) continue;
+            for (bool avx2 : {false, true}) {
+              if (!supported(avx2)) continue;
+              const char *what = avx2 ? "filterScanline_avx2"
+                                      : "filterScanline_sse2";
+              actual = expected;
+              std::fill(actual.begin() + bytewidth, actual.end(), 0xAA);
+              const size_t done =
+                  avx2 ? filterScanline_avx2(actual.data(), scanline.data(),
+                                             p, length, bytewidth, type)
+                       : filterScanline_sse2(actual.data(), scanline.data(),
+                                             p, length, bytewidth, type);
+              const size_t vector = avx2 ? 32 : 16;
+              expect(done >= bytewidth && done <= length &&
+                         done + vector > length,
+                     what, bytewidth, length, prev, type);
+              bool same = true;
+              for (size_t i = bytewidth; i < done; ++i) {
+                same = same && actual[i] == expected[i];
+              }
+              for (size_t i = done; i < length; ++i) {
+                same = same && actual[i] == 0xAA;
+              }
+              expect(same, what, bytewidth, length, prev, type);
+            }
+#endif
+          }
+        }
+      }
+    }
+  }
+#ifdef LODEPNG_FILTER_SIMD
+  // The sum kernels on every length around their loops
+  for (size_t length = 0; length <= 100; ++length) {
+    std::vector<unsigned char> filtered(length);
+    fill(random, false, 1, &filtered);
+    for (int type = 0; type < 5; ++type) {
+      for (bool avx2 : {false, true}) {
+        if (!supported(avx2)) continue;
+        size_t done;
+        const size_t sum =
+            avx2 ? filterSum_avx2(filtered.data(), length, type, &done)
+                 : filterSum_sse2(filtered.data(), length, type, &done);
+        const unsigned char *rest = filtered.data() + done;
+        expect(done <= length &&
+                   sum + scalarSum(rest, length - done, type) ==
+                       scalarSum(filtered.data(), length, type),
+               avx2 ? "filterSum_avx2" : "filterSum_sse2", 1, length, false,
+               type);
+      }
+    }
+  }
+#endif
+}
+
+/** LFS_MINSUM over whole images, against the scalar filters and sums. */
+void checkMinsum(std::mt19937 *random, int *chosen) {
+  const struct {
+    LodePNGColorType colortype;
+    unsigned bitdepth;
+  } MODES[] = {{LCT_GREY, 8},
+               {LCT_RGB, 8},
+               {LCT_RGBA, 8},
+               {LCT_RGB, 16},
+               {LCT_RGBA, 16}};
+  LodePNGEncoderSettings settings;
+  lodepng_encoder_settings_init(&settings);
+  settings.filter_strategy = LFS_MINSUM;
+  for (const auto &mode : MODES) {
+    LodePNGColorMode color;
+    lodepng_color_mode_init(&color);
+    color.colortype = mode.colortype;
+    color.bitdepth = mode.bitdepth;
+    const size_t bytewidth = lodepng_get_bpp(&color) / 8;
+    for (unsigned w : {1u, 2u, 5u, 10u, 11u, 16u, 21u, 32u, 33u, 100u}) {
+      const unsigned h = 12;
+      const size_t linebytes = w * bytewidth;
+      std::vector<unsigned char> in(linebytes * h), line(linebytes);
+      for (unsigned y = 0; y < h; ++y) {
+        fill(random, (*random)() % 4 != 0, bytewidth, &line);
+        std::copy(line.begin(), line.end(), &in[y * linebytes]);
+      }
+      std::vector<unsigned char> expected, actual((linebytes + 1) * h);
+      std::vector<unsigned char> attempt(linebytes), best(linebytes);
+      for (unsigned y = 0; y < h; ++y) {
+        const unsigned char *prevline =
+            y ? &in[(y - 1) * linebytes] : nullptr;
+        size_t smallest = 0;
+        int bestType = 0;
+        for (int type = 0; type < 5; ++type) {
+          scalarFilter(attempt.data(), &in[y * linebytes], prevline,
+                       linebytes, bytewidth, type);
+          const size_t sum = scalarSum(attempt.data(), linebytes, type);
+          if (type == 0 || sum < smallest) {
+            smallest = sum;
+            bestType = type;
+            best = attempt;
+          }
+        }
+        ++chosen[bestType];
+        expected.push_back(bestType);
+        expected.insert(expected.end(), best.begin(), best.end());
+      }
+      // In two parts, the second taking its first previous line from the
+      // first, as the encoder's threads do
+      const unsigned split = h / 3;
+      unsigned error = filterRows(actual.data(), in.data(), w, 0, split,
+                                  &color, &settings);
+      if (!error) {
+        error = filterRows(actual.data(), in.data(), w, split, h, &color,
+                           &settings);
+      }
+      bool types = !error;
+      for (unsigned y = 0; y < h; ++y) {
+        types = types && actual[y * (linebytes + 1)] ==
+                             expected[y * (linebytes + 1)];
+      }
+      expect(types, "LFS_MINSUM filter types", bytewidth, linebytes, true,
+             -1);
+      expect(!error && actual == expected, "LFS_MINSUM bytes", bytewidth,
+             linebytes, true, -1);
+    }
+    lodepng_color_mode_cleanup(&color);
+  }
+}
+
+}  // namespace
+
+int main() {
+#ifdef LODEPNG_FILTER_SIMD
+  printf("SSE2 %s, AVX2 %s\n",
+         __builtin_cpu_supports("sse2") ? "tested" : "not supported here",
+         __builtin_cpu_supports("avx2") ? "tested" : "not supported here");
+#else
+  printf("No SIMD filters on this target: only the scalar path tested\n");
+#endif
+  std::mt19937 random(20240601);
+  int chosen[5] = {0};
+  checkScanlines(&random);
+  checkMinsum(&random, chosen);
+  printf("LFS_MINSUM chose None %d, Sub %d, Up %d, Average %d, Paeth %d\n",
+         chosen[0], chosen[1], chosen[2], chosen[3], chosen[4]);
+  if (failures) {
+    fprintf(stderr, "%d of %zu filter checks failed\n", failures, checks);
+    return 1;
+  }
+  printf("%zu filter checks passed\n", checks);
+  return 0;
+}
@@ -804,59 +804,47 @@ static unsigned HuffmanTree_makeTable(HuffmanTree* tree) {
 
 /*
 Second step for the ...makeFromLengths and ...makeFromFrequencies functions.
-numcodes, lengths and maxbitlen must already be filled in correctly. return
-value is error.
+numcodes, lengths and maxbitlen must already be filled in correctly, and codes
+must have room for numcodes codes. maxbitlen is at most 15 in deflate.
 */
-static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree) {
-  unsigned* blcount;
-  unsigned* nextcode;
-  unsigned error = 0;
+static void HuffmanTree_makeFromLengths2(HuffmanTree* tree) {
+  unsigned blcount[16];
+  unsigned nextcode[16];
   unsigned bits, n;
 
-  tree->codes = (unsigned*)lodepng_malloc(tree->numcodes * sizeof(unsigned));
-  blcount = (unsigned*)lodepng_malloc((tree->maxbitlen + 1) * sizeof(unsigned));
-  nextcode = (unsigned*)lodepng_malloc((tree->maxbitlen + 1) * sizeof(unsigned));
-  if(!tree->codes || !blcount || !nextcode) error = 83; /*alloc fail*/
-
-  if(!error) {
-    for(n = 0; n != tree->maxbitlen + 1; n++) blcount[n] = nextcode[n] = 0;
-    /*step 1: count number of instances of each code length*/
-    for(bits = 0; bits != tree->numcodes; ++bits) ++blcount[tree->lengths[bits]];
-    /*step 2: generate the nextcode values*/
-    for(bits = 1; bits <= tree->maxbitlen; ++bits) {
-      nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1u;
-    }
-    /*step 3: generate all the codes*/
-    for(n = 0; n != tree->numcodes; ++n) {
-      if(tree->lengths[n] != 0) {
-        tree->codes[n] = nextcode[tree->lengths[n]]++;
-        /*remove superfluous bits from the code*/
-        tree->codes[n] &= ((1u << tree->lengths[n]) - 1u);
-      }
+  for(n = 0; n != 16; n++) blcount[n] = nextcode[n] = 0;
+  /*step 1: count number of instances of each code length*/
+  for(bits = 0; bits != tree->numcodes; ++bits) ++blcount[tree->lengths[bits]];
+  /*step 2: generate the nextcode values*/
+  for(bits = 1; bits <= tree->maxbitlen; ++bits) {
+    nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1u;
+  }
+  /*step 3: generate all the codes*/
+  for(n = 0; n != tree->numcodes; ++n) {
+    if(tree->lengths[n] != 0) {
+      tree->codes[n] = nextcode[tree->lengths[n]]++;
+      /*remove superfluous bits from the code*/
+      tree->codes[n] &= ((1u << tree->lengths[n]) - 1u);
     }
   }
-
-  lodepng_free(blcount);
-  lodepng_free(nextcode);
-
-  if(!error) error = HuffmanTree_makeTable(tree);
-  return error;
 }
 
 /*
 given the code lengths (as stored in the PNG file), generate the tree as defined
-by Deflate. maxbitlen is the maximum bits that a code in the tree can have.
-return value is error.
+by Deflate, including the decoding table. maxbitlen is the maximum bits that a
+code in the tree can have. return value is error.
 */
 static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* bitlen,
                                             size_t numcodes, unsigned maxbitlen) {
   unsigned i;
   tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
-  if(!tree->lengths) return 83; /*alloc fail*/
+  tree->codes = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
+  if(!tree->lengths || !tree->codes) return 83; /*alloc fail*/
   for(i = 0; i != numcodes; ++i) tree->lengths[i] = bitlen[i];
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
   tree->maxbitlen = maxbitlen;
-  return HuffmanTree_makeFromLengths2(tree);
+  HuffmanTree_makeFromLengths2(tree);
+  return HuffmanTree_makeTable(tree);
 }
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -915,9 +903,8 @@ static BPMNode* bpmnode_create(BPMLists* lists, int weight, unsigned index, BPMN
   return result;
 }
 
-/*sort the leaves with stable mergesort*/
-static void bpmnode_sort(BPMNode* leaves, size_t num) {
-  BPMNode* mem = (BPMNode*)lodepng_malloc(sizeof(*leaves) * num);
+/*sort the leaves with stable mergesort, mem is scratch space for num nodes*/
+static void bpmnode_sort(BPMNode* leaves, BPMNode* mem, size_t num) {
   size_t width, counter = 0;
   for(width = 1; width < num; width *= 2) {
     BPMNode* a = (counter & 1) ? mem : leaves;
@@ -935,7 +922,6 @@ static void bpmnode_sort(BPMNode* leaves, size_t num) {
     counter++;
   }
   if(counter & 1) lodepng_memcpy(leaves, mem, sizeof(*leaves) * num);
-  lodepng_free(mem);
 }
 
 /*Boundary Package Merge step, numpresent is the amount of leaves, and c is the current chain.*/
@@ -964,19 +950,29 @@ static void boundaryPM(BPMLists* lists, BPMNode* leaves, size_t numpresent, int
   }
 }
 
-unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
-                                      size_t numcodes, unsigned maxbitlen) {
-  unsigned error = 0;
+/*
+The memory lodepng_huffman_code_lengths needs besides lengths: leaves and sorted
+for numcodes nodes, memory and freelist for 2 * maxbitlen * (maxbitlen + 1) and
+chains0 and chains1 for maxbitlen.
+*/
+typedef struct BPMScratch {
+  BPMNode* leaves; /*the symbols, only those with > 0 frequency*/
+  BPMNode* sorted;
+  BPMNode* memory;
+  BPMNode** freelist;
+  BPMNode** chains0;
+  BPMNode** chains1;
+} BPMScratch;
+
+static unsigned huffmanCodeLengths(unsigned* lengths, const unsigned* frequencies,
+                                   size_t numcodes, unsigned maxbitlen, const BPMScratch* scratch) {
   unsigned i;
   size_t numpresent = 0; /*number of symbols with non-zero frequency*/
-  BPMNode* leaves; /*the symbols, only those with > 0 frequency*/
+  BPMNode* leaves = scratch->leaves;
 
   if(numcodes == 0) return 80; /*error: a tree of 0 symbols is not supposed to be made*/
   if((1u << maxbitlen) < (unsigned)numcodes) return 80; /*error: represent all symbols*/
 
-  leaves = (BPMNode*)lodepng_malloc(numcodes * sizeof(*leaves));
-  if(!leaves) return 83; /*alloc fail*/
-
   for(i = 0; i != numcodes; ++i) {
     if(frequencies[i] > 0) {
       leaves[numpresent].weight = (int)frequencies[i];
@@ -1001,59 +997,79 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
     BPMLists lists;
     BPMNode* node;
 
-    bpmnode_sort(leaves, numpresent);
+    bpmnode_sort(leaves, scratch->sorted, numpresent);
 
     lists.listsize = maxbitlen;
     lists.memsize = 2 * maxbitlen * (maxbitlen + 1);
     lists.nextfree = 0;
     lists.numfree = lists.memsize;
-    lists.memory = (BPMNode*)lodepng_malloc(lists.memsize * sizeof(*lists.memory));
-    lists.freelist = (BPMNode**)lodepng_malloc(lists.memsize * sizeof(BPMNode*));
-    lists.chains0 = (BPMNode**)lodepng_malloc(lists.listsize * sizeof(BPMNode*));
-    lists.chains1 = (BPMNode**)lodepng_malloc(lists.listsize * sizeof(BPMNode*));
-    if(!lists.memory || !lists.freelist || !lists.chains0 || !lists.chains1) error = 83; /*alloc fail*/
+    lists.memory = scratch->memory;
+    lists.freelist = scratch->freelist;
+    lists.chains0 = scratch->chains0;
+    lists.chains1 = scratch->chains1;
 
-    if(!error) {
-      for(i = 0; i != lists.memsize; ++i) lists.freelist[i] = &lists.memory[i];
+    for(i = 0; i != lists.memsize; ++i) lists.freelist[i] = &lists.memory[i];
 
-      bpmnode_create(&lists, leaves[0].weight, 1, 0);
-      bpmnode_create(&lists, leaves[1].weight, 2, 0);
+    bpmnode_create(&lists, leaves[0].weight, 1, 0);
+    bpmnode_create(&lists, leaves[1].weight, 2, 0);
 
-      for(i = 0; i != lists.listsize; ++i) {
-        lists.chains0[i] = &lists.memory[0];
-        lists.chains1[i] = &lists.memory[1];
-      }
+    for(i = 0; i != lists.listsize; ++i) {
+      lists.chains0[i] = &lists.memory[0];
+      lists.chains1[i] = &lists.memory[1];
+    }
 
-      /*each boundaryPM call adds one chain to the last list, and we need 2 * numpresent - 2 chains.*/
-      for(i = 2; i != 2 * numpresent - 2; ++i) boundaryPM(&lists, leaves, numpresent, (int)maxbitlen - 1, (int)i);
+    /*each boundaryPM call adds one chain to the last list, and we need 2 * numpresent - 2 chains.*/
+    for(i = 2; i != 2 * numpresent - 2; ++i) boundaryPM(&lists, leaves, numpresent, (int)maxbitlen - 1, (int)i);
 
-      for(node = lists.chains1[maxbitlen - 1]; node; node = node->tail) {
-        for(i = 0; i != node->index; ++i) ++lengths[leaves[i].index];
-      }
+    for(node = lists.chains1[maxbitlen - 1]; node; node = node->tail) {
+      for(i = 0; i != node->index; ++i) ++lengths[leaves[i].index];
     }
-
-    lodepng_free(lists.memory);
-    lodepng_free(lists.freelist);
-    lodepng_free(lists.chains0);
-    lodepng_free(lists.chains1);
   }
 
-  lodepng_free(leaves);
+  return 0;
+}
+
+unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
+                                      size_t numcodes, unsigned maxbitlen) {
+  unsigned error = 0;
+  size_t memsize = 2 * maxbitlen * (maxbitlen + 1);
+  BPMScratch scratch;
+  scratch.leaves = (BPMNode*)lodepng_malloc(numcodes * sizeof(BPMNode));
+  scratch.sorted = (BPMNode*)lodepng_malloc(numcodes * sizeof(BPMNode));
+  scratch.memory = (BPMNode*)lodepng_malloc(memsize * sizeof(BPMNode));
+  scratch.freelist = (BPMNode**)lodepng_malloc(memsize * sizeof(BPMNode*));
+  scratch.chains0 = (BPMNode**)lodepng_malloc(maxbitlen * sizeof(BPMNode*));
+  scratch.chains1 = (BPMNode**)lodepng_malloc(maxbitlen * sizeof(BPMNode*));
+  if(!scratch.leaves || !scratch.sorted || !scratch.memory || !scratch.freelist || !scratch.chains0 ||
+     !scratch.chains1) {
+    error = 83; /*alloc fail*/
+  }
+
+  if(!error) error = huffmanCodeLengths(lengths, frequencies, numcodes, maxbitlen, &scratch);
+
+  lodepng_free(scratch.leaves);
+  lodepng_free(scratch.sorted);
+  lodepng_free(scratch.memory);
+  lodepng_free(scratch.freelist);
+  lodepng_free(scratch.chains0);
+  lodepng_free(scratch.chains1);
   return error;
 }
 
-/*Create the Huffman tree given the symbol frequencies*/
+/*
+Create the Huffman tree given the symbol frequencies, for encoding only, so without
+the decoding table. The lengths and codes of tree must have room for numcodes.
+*/
 static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigned* frequencies,
-                                                size_t mincodes, size_t numcodes, unsigned maxbitlen) {
+                                                size_t mincodes, size_t numcodes, unsigned maxbitlen,
+                                                const BPMScratch* scratch) {
   unsigned error = 0;
   while(!frequencies[numcodes - 1] && numcodes > mincodes) --numcodes; /*trim zeroes*/
-  tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
-  if(!tree->lengths) return 83; /*alloc fail*/
   tree->maxbitlen = maxbitlen;
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
 
-  error = lodepng_huffman_code_lengths(tree->lengths, frequencies, numcodes, maxbitlen);
-  if(!error) error = HuffmanTree_makeFromLengths2(tree);
+  error = huffmanCodeLengths(tree->lengths, frequencies, numcodes, maxbitlen, scratch);
+  if(!error) HuffmanTree_makeFromLengths2(tree);
   return error;
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -1504,8 +1520,18 @@ typedef struct Hash {
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize) {
+/*empties the hash chains, to be reused for new data*/
+static void hash_reset(Hash* hash, unsigned windowsize) {
   unsigned i;
+  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
+
+  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+}
+
+static unsigned hash_init(Hash* hash, unsigned windowsize) {
   hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
@@ -1518,14 +1544,7 @@ static unsigned hash_init(Hash* hash, unsigned windowsize) {
     return 83; /*alloc fail*/
   }
 
-  /*initialize hash table*/
-  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
-
-  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
-
+  hash_reset(hash, windowsize);
   return 0;
 }
 
@@ -1739,9 +1758,113 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*
+LZ77-encode like encodeLZ77, but for speed over size: only the most recent earlier position
+with the same hash is tried, any match is taken immediately (no lazy matching), and the
+positions inside longer matches are not added to the hash table, like zlib's deflate_fast.
+Since matches are verified byte by byte, an outdated hash entry only costs a missed match.
+*/
+static unsigned encodeLZ77Greedy(uivector* out, Hash* hash,
+                                 const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
+                                 unsigned minmatch) {
+  /*matches up to this length still get their positions hashed, as in zlib's level 1*/
+  static const unsigned MAX_INSERT_LENGTH = 4;
+  size_t pos = inpos;
+  unsigned i;
+
+  if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
+  if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
+
+  while(pos < insize) {
+    size_t wpos = pos & (windowsize - 1);
+    unsigned hashval = getHash(in, insize, pos);
+    int candidate = hash->head[hashval];
+    unsigned length = 0;
+    unsigned offset = 0;
+
+    if(candidate != -1 && hash->val[candidate] == (int)hashval) {
+      offset = (unsigned)((wpos - (size_t)candidate) & (windowsize - 1));
+      if(offset != 0 && offset <= pos) {
+        const unsigned char* foreptr = &in[pos];
+        const unsigned char* backptr = &in[pos - offset];
+        const unsigned char* lastptr =
+            &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+        while(foreptr != lastptr && *backptr == *foreptr) {
+          ++backptr;
+          ++foreptr;
+        }
+        length = (unsigned)(foreptr - &in[pos]);
+      }
+    }
+    hash->val[wpos] = (int)hashval;
+    hash->head[hashval] = (int)wpos;
+
+    if(length < 3 || length < minmatch || (length == 3 && offset > 4096)) {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+      continue;
+    }
+    addLengthDistance(out, length, offset);
+    if(length <= MAX_INSERT_LENGTH) {
+      for(i = 1; i < length; ++i) {
+        size_t ipos = pos + i;
+        unsigned ihash = getHash(in, insize, ipos);
+        hash->val[ipos & (windowsize - 1)] = (int)ihash;
+        hash->head[ihash] = (int)(ipos & (windowsize - 1));
+      }
+    }
+    pos += length;
+  }
+  return 0;
+}
+
+/*
+LZ77-encode using only runs of the previous byte, that is matches at distance 1, like zlib's
+Z_RLE strategy. No hash table is needed. On filtered PNG data most of the redundancy is in
+runs of zeros, so this keeps much of the compression at a fraction of the cost.
+*/
+static unsigned encodeLZ77RLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize,
+                              unsigned minmatch) {
+  size_t pos = inpos;
+  while(pos < insize) {
+    unsigned length = 0;
+    if(pos > 0) {
+      const unsigned char prev = in[pos - 1];
+      size_t max = insize - pos;
+      if(max > MAX_SUPPORTED_DEFLATE_LENGTH) max = MAX_SUPPORTED_DEFLATE_LENGTH;
+      while(length < max && in[pos + length] == prev) ++length;
+    }
+    if(length < 3 || length < minmatch) {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+    } else {
+      addLengthDistance(out, length, 1);
+      pos += length;
+    }
+  }
+  return 0;
+}
+
+/*LZ77-encode in[inpos..insize) with the match strategy chosen in the settings*/
+static unsigned encodeLZ77WithSettings(uivector* out, Hash* hash,
+                                       const unsigned char* in, size_t inpos, size_t insize,
+                                       const LodePNGCompressSettings* settings) {
+  switch(settings->match_strategy) {
+    case LMS_CHAIN:
+      return encodeLZ77(out, hash, in, inpos, insize, settings->windowsize,
+                        settings->minmatch, settings->nicematch, settings->lazymatching);
+    case LMS_GREEDY:
+      return encodeLZ77Greedy(out, hash, in, inpos, insize, settings->windowsize, settings->minmatch);
+    case LMS_RLE:
+      return encodeLZ77RLE(out, in, inpos, insize, settings->minmatch);
+  }
+  return 114; /*unknown match strategy*/
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize) {
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize,
+                                     unsigned final) {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
@@ -1752,7 +1875,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     unsigned char firstbyte;
     size_t pos = out->size;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     LEN = 65535;
@@ -1803,8 +1926,70 @@ static void writeLZ77data(LodePNGBitWriter* writer, const uivector* lz77_encoded
   }
 }
 
+/*the most nodes that huffmanCodeLengths needs for the chains of a deflate tree, which are at most 15 bits*/
+#define MAX_BPM_NODES (2 * 15 * (15 + 1))
+
+/*
+Everything the encoder needs memory for besides the output: the hash chains, the LZ77 symbols, the Huffman
+trees and the scratch memory to build them. Kept between calls, so that compressing many parts of the same
+size with the same settings only allocates during the first.
+*/
+struct LodePNGDeflateContext {
+  Hash hash;
+  unsigned hashallocated; /*whether hash is allocated, for windowsize hashsize*/
+  unsigned hashsize;
+  uivector lz77_encoded;
+  ucvector out; /*output of lodepng_deflate_part_reuse*/
+
+  HuffmanTree tree_ll, tree_d, tree_cl; /*using the arrays below*/
+  unsigned lengths_ll[286], codes_ll[286];
+  unsigned lengths_d[30], codes_d[30];
+  unsigned lengths_cl[NUM_CODE_LENGTH_CODES], codes_cl[NUM_CODE_LENGTH_CODES];
+  unsigned frequencies_ll[286], frequencies_d[30], frequencies_cl[NUM_CODE_LENGTH_CODES];
+  unsigned bitlen_lld[286 + 30], bitlen_lld_e[286 + 30];
+
+  BPMScratch scratch; /*using the arrays below*/
+  BPMNode leaves[286], sorted[286], memory[MAX_BPM_NODES];
+  BPMNode* freelist[MAX_BPM_NODES];
+  BPMNode* chains0[15];
+  BPMNode* chains1[15];
+};
+
+LodePNGDeflateContext* lodepng_deflate_context_new(void) {
+  LodePNGDeflateContext* context = (LodePNGDeflateContext*)lodepng_malloc(sizeof(LodePNGDeflateContext));
+  if(!context) return 0;
+  context->hashallocated = 0;
+  context->hashsize = 0;
+  uivector_init(&context->lz77_encoded);
+  context->out = ucvector_init(NULL, 0);
+  HuffmanTree_init(&context->tree_ll);
+  context->tree_ll.lengths = context->lengths_ll;
+  context->tree_ll.codes = context->codes_ll;
+  HuffmanTree_init(&context->tree_d);
+  context->tree_d.lengths = context->lengths_d;
+  context->tree_d.codes = context->codes_d;
+  HuffmanTree_init(&context->tree_cl);
+  context->tree_cl.lengths = context->lengths_cl;
+  context->tree_cl.codes = context->codes_cl;
+  context->scratch.leaves = context->leaves;
+  context->scratch.sorted = context->sorted;
+  context->scratch.memory = context->memory;
+  context->scratch.freelist = context->freelist;
+  context->scratch.chains0 = context->chains0;
+  context->scratch.chains1 = context->chains1;
+  return context;
+}
+
+void lodepng_deflate_context_delete(LodePNGDeflateContext* context) {
+  if(!context) return;
+  if(context->hashallocated) hash_cleanup(&context->hash);
+  uivector_cleanup(&context->lz77_encoded);
+  lodepng_free(context->out.data);
+  lodepng_free(context);
+}
+
 /*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
-static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
+static unsigned deflateDynamic(LodePNGBitWriter* writer, LodePNGDeflateContext* context,
                                const unsigned char* data, size_t datapos, size_t dataend,
                                const LodePNGCompressSettings* settings, unsigned final) {
   unsigned error = 0;
@@ -1821,15 +2006,15 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   */
 
   /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
-  uivector lz77_encoded;
-  HuffmanTree tree_ll; /*tree for lit,len values*/
-  HuffmanTree tree_d; /*tree for distance codes*/
-  HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
-  unsigned* frequencies_ll = 0; /*frequency of lit,len codes*/
-  unsigned* frequencies_d = 0; /*frequency of dist codes*/
-  unsigned* frequencies_cl = 0; /*frequency of code length codes*/
-  unsigned* bitlen_lld = 0; /*lit,len,dist code lengths (int bits), literally (without repeat codes).*/
-  unsigned* bitlen_lld_e = 0; /*bitlen_lld encoded with repeat codes (this is a rudimentary run length compression)*/
+  uivector* lz77_encoded = &context->lz77_encoded;
+  HuffmanTree* tree_ll = &context->tree_ll; /*tree for lit,len values*/
+  HuffmanTree* tree_d = &context->tree_d; /*tree for distance codes*/
+  HuffmanTree* tree_cl = &context->tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
+  unsigned* frequencies_ll = context->frequencies_ll; /*frequency of lit,len codes*/
+  unsigned* frequencies_d = context->frequencies_d; /*frequency of dist codes*/
+  unsigned* frequencies_cl = context->frequencies_cl; /*frequency of code length codes*/
+  unsigned* bitlen_lld = context->bitlen_lld; /*lit,len,dist code lengths (int bits), literally (without repeat codes).*/
+  unsigned* bitlen_lld_e = context->bitlen_lld_e; /*bitlen_lld encoded with repeat codes (this is a rudimentary run length compression)*/
   size_t datasize = dataend - datapos;
 
   /*
@@ -1846,16 +2031,7 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   size_t numcodes_ll, numcodes_d, numcodes_lld, numcodes_lld_e, numcodes_cl;
   unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
-  HuffmanTree_init(&tree_cl);
-  /* could fit on stack, but >1KB is on the larger side so allocate instead */
-  frequencies_ll = (unsigned*)lodepng_malloc(286 * sizeof(*frequencies_ll));
-  frequencies_d = (unsigned*)lodepng_malloc(30 * sizeof(*frequencies_d));
-  frequencies_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
-
-  if(!frequencies_ll || !frequencies_d || !frequencies_cl) error = 83; /*alloc fail*/
+  lz77_encoded->size = 0;
 
   /*This while loop never loops due to a break at the end, it is here to
   allow breaking out of it to the cleanup phase on error conditions.*/
@@ -1865,20 +2041,19 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     lodepng_memset(frequencies_cl, 0, NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
 
     if(settings->use_lz77) {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77WithSettings(lz77_encoded, &context->hash, data, datapos, dataend, settings);
       if(error) break;
     } else {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
-      for(i = datapos; i < dataend; ++i) lz77_encoded.data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
+      if(!uivector_resize(lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
+      for(i = datapos; i < dataend; ++i) lz77_encoded->data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
     }
 
     /*Count the frequencies of lit, len and dist codes*/
-    for(i = 0; i != lz77_encoded.size; ++i) {
-      unsigned symbol = lz77_encoded.data[i];
+    for(i = 0; i != lz77_encoded->size; ++i) {
+      unsigned symbol = lz77_encoded->data[i];
       ++frequencies_ll[symbol];
       if(symbol > 256) {
-        unsigned dist = lz77_encoded.data[i + 2];
+        unsigned dist = lz77_encoded->data[i + 2];
         ++frequencies_d[dist];
         i += 3;
       }
@@ -1886,24 +2061,21 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     frequencies_ll[256] = 1; /*there will be exactly 1 end code, at the end of the block*/
 
     /*Make both huffman trees, one for the lit and len codes, one for the dist codes*/
-    error = HuffmanTree_makeFromFrequencies(&tree_ll, frequencies_ll, 257, 286, 15);
+    error = HuffmanTree_makeFromFrequencies(tree_ll, frequencies_ll, 257, 286, 15, &context->scratch);
     if(error) break;
     /*2, not 1, is chosen for mincodes: some buggy PNG decoders require at least 2 symbols in the dist tree*/
-    error = HuffmanTree_makeFromFrequencies(&tree_d, frequencies_d, 2, 30, 15);
+    error = HuffmanTree_makeFromFrequencies(tree_d, frequencies_d, 2, 30, 15, &context->scratch);
     if(error) break;
 
-    numcodes_ll = LODEPNG_MIN(tree_ll.numcodes, 286);
-    numcodes_d = LODEPNG_MIN(tree_d.numcodes, 30);
+    numcodes_ll = LODEPNG_MIN(tree_ll->numcodes, 286);
+    numcodes_d = LODEPNG_MIN(tree_d->numcodes, 30);
     /*store the code lengths of both generated trees in bitlen_lld*/
     numcodes_lld = numcodes_ll + numcodes_d;
-    bitlen_lld = (unsigned*)lodepng_malloc(numcodes_lld * sizeof(*bitlen_lld));
     /*numcodes_lld_e never needs more size than bitlen_lld*/
-    bitlen_lld_e = (unsigned*)lodepng_malloc(numcodes_lld * sizeof(*bitlen_lld_e));
-    if(!bitlen_lld || !bitlen_lld_e) ERROR_BREAK(83); /*alloc fail*/
     numcodes_lld_e = 0;
 
-    for(i = 0; i != numcodes_ll; ++i) bitlen_lld[i] = tree_ll.lengths[i];
-    for(i = 0; i != numcodes_d; ++i) bitlen_lld[numcodes_ll + i] = tree_d.lengths[i];
+    for(i = 0; i != numcodes_ll; ++i) bitlen_lld[i] = tree_ll->lengths[i];
+    for(i = 0; i != numcodes_d; ++i) bitlen_lld[numcodes_ll + i] = tree_d->lengths[i];
 
     /*run-length compress bitlen_ldd into bitlen_lld_e by using repeat codes 16 (copy length 3-6 times),
     17 (3-10 zeroes), 18 (11-138 zeroes)*/
@@ -1949,14 +2121,14 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
       if(bitlen_lld_e[i] >= 16) ++i;
     }
 
-    error = HuffmanTree_makeFromFrequencies(&tree_cl, frequencies_cl,
-                                            NUM_CODE_LENGTH_CODES, NUM_CODE_LENGTH_CODES, 7);
+    error = HuffmanTree_makeFromFrequencies(tree_cl, frequencies_cl,
+                                            NUM_CODE_LENGTH_CODES, NUM_CODE_LENGTH_CODES, 7, &context->scratch);
     if(error) break;
 
     /*compute amount of code-length-code-lengths to output*/
     numcodes_cl = NUM_CODE_LENGTH_CODES;
     /*trim zeros at the end (using CLCL_ORDER), but minimum size must be 4 (see HCLEN below)*/
-    while(numcodes_cl > 4u && tree_cl.lengths[CLCL_ORDER[numcodes_cl - 1u]] == 0) {
+    while(numcodes_cl > 4u && tree_cl->lengths[CLCL_ORDER[numcodes_cl - 1u]] == 0) {
       numcodes_cl--;
     }
 
@@ -1990,11 +2162,11 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     writeBits(writer, HCLEN, 4);
 
     /*write the code lengths of the code length alphabet ("bitlen_cl")*/
-    for(i = 0; i != numcodes_cl; ++i) writeBits(writer, tree_cl.lengths[CLCL_ORDER[i]], 3);
+    for(i = 0; i != numcodes_cl; ++i) writeBits(writer, tree_cl->lengths[CLCL_ORDER[i]], 3);
 
     /*write the lengths of the lit/len AND the dist alphabet*/
     for(i = 0; i != numcodes_lld_e; ++i) {
-      writeBitsReversed(writer, tree_cl.codes[bitlen_lld_e[i]], tree_cl.lengths[bitlen_lld_e[i]]);
+      writeBitsReversed(writer, tree_cl->codes[bitlen_lld_e[i]], tree_cl->lengths[bitlen_lld_e[i]]);
       /*extra bits of repeat codes*/
       if(bitlen_lld_e[i] == 16) writeBits(writer, bitlen_lld_e[++i], 2);
       else if(bitlen_lld_e[i] == 17) writeBits(writer, bitlen_lld_e[++i], 3);
@@ -2002,31 +2174,20 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     }
 
     /*write the compressed data symbols*/
-    writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
+    writeLZ77data(writer, lz77_encoded, tree_ll, tree_d);
     /*error: the length of the end code 256 must be larger than 0*/
-    if(tree_ll.lengths[256] == 0) ERROR_BREAK(64);
+    if(tree_ll->lengths[256] == 0) ERROR_BREAK(64);
 
     /*write the end code*/
-    writeBitsReversed(writer, tree_ll.codes[256], tree_ll.lengths[256]);
+    writeBitsReversed(writer, tree_ll->codes[256], tree_ll->lengths[256]);
 
     break; /*end of error-while*/
   }
 
-  /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
-  HuffmanTree_cleanup(&tree_cl);
-  lodepng_free(frequencies_ll);
-  lodepng_free(frequencies_d);
-  lodepng_free(frequencies_cl);
-  lodepng_free(bitlen_lld);
-  lodepng_free(bitlen_lld_e);
-
   return error;
 }
 
-static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
+static unsigned deflateFixed(LodePNGBitWriter* writer, LodePNGDeflateContext* context,
                              const unsigned char* data,
                              size_t datapos, size_t dataend,
                              const LodePNGCompressSettings* settings, unsigned final) {
@@ -2049,12 +2210,10 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
     writeBits(writer, 0, 1); /*second bit of BTYPE*/
 
     if(settings->use_lz77) /*LZ77 encoded*/ {
-      uivector lz77_encoded;
-      uivector_init(&lz77_encoded);
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
-      if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
-      uivector_cleanup(&lz77_encoded);
+      uivector* lz77_encoded = &context->lz77_encoded;
+      lz77_encoded->size = 0;
+      error = encodeLZ77WithSettings(lz77_encoded, &context->hash, data, datapos, dataend, settings);
+      if(!error) writeLZ77data(writer, lz77_encoded, &tree_ll, &tree_d);
     } else /*no LZ77, but still will be Huffman compressed*/ {
       for(i = datapos; i < dataend; ++i) {
         writeBitsReversed(writer, tree_ll.codes[data[i]], tree_ll.lengths[data[i]]);
@@ -2071,17 +2230,21 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings) {
+/*deflates in[start..end), using the up to windowsize bytes before start as dictionary, with the memory of
+context. If final is 0, the output ends with an empty stored block so that it is byte aligned.*/
+static unsigned lodepng_deflatev_part(ucvector* out, LodePNGDeflateContext* context,
+                                      const unsigned char* in, size_t start, size_t end,
+                                      unsigned final, const LodePNGCompressSettings* settings) {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
-  Hash hash;
+  size_t insize = end - start;
+  Hash* hash = &context->hash;
   LodePNGBitWriter writer;
 
   LodePNGBitWriter_init(&writer, out);
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 0) return deflateNoCompression(out, in + start, insize, final);
   else if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/ {
     /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
@@ -2093,25 +2256,84 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
+  if(context->hashallocated && context->hashsize == settings->windowsize) {
+    hash_reset(hash, settings->windowsize);
+  } else {
+    if(context->hashallocated) hash_cleanup(hash);
+    context->hashallocated = 0;
+    error = hash_init(hash, settings->windowsize);
+    if(error) {
+      hash_cleanup(hash);
+    } else {
+      context->hashallocated = 1;
+      context->hashsize = settings->windowsize;
+    }
+  }
+
+  if(!error && settings->use_lz77 && start > 0) {
+    /*prime the hash chains with the window before start, the same way encodeLZ77 would have*/
+    size_t pos = start > settings->windowsize ? start - settings->windowsize : 0;
+    unsigned numzeros = 0;
+    if(settings->windowsize == 0 || settings->windowsize > 32768) error = 60;
+    else if((settings->windowsize & (settings->windowsize - 1)) != 0) error = 90;
+    for(; pos < start && !error; ++pos) {
+      unsigned hashval = getHash(in, end, pos);
+      if(hashval == 0) {
+        if(numzeros == 0) numzeros = countZeros(in, end, pos);
+        else if(pos + numzeros > end || in[pos + numzeros - 1] != 0) --numzeros;
+      } else {
+        numzeros = 0;
+      }
+      updateHashChain(hash, pos & (settings->windowsize - 1), hashval, numzeros);
+    }
+  }
 
   if(!error) {
     for(i = 0; i != numdeflateblocks && !error; ++i) {
-      unsigned final = (i == numdeflateblocks - 1);
-      size_t start = i * blocksize;
-      size_t end = start + blocksize;
-      if(end > insize) end = insize;
+      unsigned lastblock = (i == numdeflateblocks - 1);
+      size_t blockstart = start + i * blocksize;
+      size_t blockend = blockstart + blocksize;
+      if(blockend > end) blockend = end;
+
+      if(settings->btype == 1) {
+        error = deflateFixed(&writer, context, in, blockstart, blockend, settings, final && lastblock);
+      } else if(settings->btype == 2) {
+        error = deflateDynamic(&writer, context, in, blockstart, blockend, settings, final && lastblock);
+      }
+    }
+  }
 
-      if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, final);
-      else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, final);
+  if(!error && !final) {
+    /*sync flush: an empty stored block, whose LEN starts at the next byte boundary*/
+    writeBits(&writer, 0, 3);
+    if(!ucvector_resize(out, out->size + 4)) error = 83; /*alloc fail*/
+    else {
+      out->data[out->size - 4] = 0;
+      out->data[out->size - 3] = 0;
+      out->data[out->size - 2] = 255;
+      out->data[out->size - 1] = 255;
     }
   }
 
-  hash_cleanup(&hash);
+  return error;
+}
 
+/*lodepng_deflatev_part with a context of its own*/
+static unsigned deflatev_part_once(ucvector* out, const unsigned char* in, size_t start, size_t end,
+                                   unsigned final, const LodePNGCompressSettings* settings) {
+  unsigned error;
+  LodePNGDeflateContext* context = lodepng_deflate_context_new();
+  if(!context) return 83; /*alloc fail*/
+  error = lodepng_deflatev_part(out, context, in, start, end, final, settings);
+  lodepng_deflate_context_delete(context);
   return error;
 }
 
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings) {
+  return deflatev_part_once(out, in, 0, insize, 1, settings);
+}
+
 unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings) {
@@ -2122,6 +2344,30 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
   return error;
 }
 
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t start, size_t end, unsigned final,
+                              const LodePNGCompressSettings* settings) {
+  ucvector v = ucvector_init(*out, *outsize);
+  unsigned error = deflatev_part_once(&v, in, start, end, final, settings);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
+unsigned lodepng_deflate_part_reuse(LodePNGDeflateContext* context, const unsigned char** out, size_t* outsize,
+                                    const unsigned char* in, size_t start, size_t end, unsigned final,
+                                    const LodePNGCompressSettings* settings) {
+  unsigned error;
+  /*room for a little expansion up front, so that the output is not reallocated as it grows*/
+  size_t hint = (end - start) + (end - start) / 8u + 64u;
+  if(!ucvector_resize(&context->out, hint)) return 83; /*alloc fail*/
+  context->out.size = 0;
+  error = lodepng_deflatev_part(&context->out, context, in, start, end, final, settings);
+  *out = context->out.data;
+  *outsize = context->out.size;
+  return error;
+}
+
 static unsigned deflate(unsigned char** out, size_t* outsize,
                         const unsigned char* in, size_t insize,
                         const LodePNGCompressSettings* settings) {
@@ -2140,7 +2386,7 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
+static unsigned update_adler32_scalar(unsigned adler, const unsigned char* data, unsigned len) {
   unsigned s1 = adler & 0xffffu;
   unsigned s2 = (adler >> 16u) & 0xffffu;
 
@@ -2160,11 +2406,138 @@ static unsigned update_adler32(unsigned adler, const unsigned char* data, unsign
   return (s2 << 16u) | s1;
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_ADLER32_SIMD
+#include <immintrin.h>
+
+/*
+The SIMD versions below process 32-byte blocks: s1 gains the plain byte sum (psadbw), s2 gains the
+byte sum weighted 32..1 by position (pmaddubsw, pmaddwd) plus 32 times the s1 of before the block.
+That last term is accumulated per block in v_ps and multiplied by 32 once per run of blocks. A run
+is at most 5552 / 32 blocks, the same bound as the scalar version, before reducing modulo 65521.
+The remaining len % 32 bytes are done by the scalar version. Only call these if the CPU has the
+instruction set in their target attribute.
+*/
+__attribute__((target("ssse3")))
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, unsigned len) {
+  unsigned s1 = adler & 0xffffu;
+  unsigned s2 = (adler >> 16u) & 0xffffu;
+  unsigned blocks = len / 32u;
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  len -= blocks * 32u;
+
+  while(blocks != 0u) {
+    unsigned n = blocks > 5552u / 32u ? 5552u / 32u : blocks;
+    __m128i v_ps = _mm_cvtsi32_si128((int)(s1 * n));
+    __m128i v_s1 = zero;
+    __m128i v_s2 = _mm_cvtsi32_si128((int)s2);
+    blocks -= n;
+    do {
+      const __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+      const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += 32;
+    } while(--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+    /*horizontal sums of the 32-bit lanes*/
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(v_s1)) % 65521u;
+    s2 = (unsigned)_mm_cvtsi128_si32(v_s2) % 65521u;
+  }
+
+  return update_adler32_scalar((s2 << 16u) | s1, data, len);
+}
+
+__attribute__((target("avx2")))
+static unsigned update_adler32_avx2(unsigned adler, const unsigned char* data, unsigned len) {
+  unsigned s1 = adler & 0xffffu;
+  unsigned s2 = (adler >> 16u) & 0xffffu;
+  unsigned blocks = len / 32u;
+  const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                       16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  len -= blocks * 32u;
+
+  while(blocks != 0u) {
+    unsigned n = blocks > 5552u / 32u ? 5552u / 32u : blocks;
+    __m256i v_ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+    __m256i v_s1 = zero;
+    __m256i v_s2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+    __m128i h1, h2;
+    blocks -= n;
+    do {
+      const __m256i bytes = _mm256_loadu_si256((const __m256i*)data);
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+      data += 32;
+    } while(--n);
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+    /*horizontal sums of the 32-bit lanes*/
+    h1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    h2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(1, 0, 3, 2)));
+    h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(2, 3, 0, 1)));
+    h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(h1)) % 65521u;
+    s2 = (unsigned)_mm_cvtsi128_si32(h2) % 65521u;
+  }
+
+  return update_adler32_scalar((s2 << 16u) | s1, data, len);
+}
+#endif /*defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))*/
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
+#ifdef LODEPNG_ADLER32_SIMD
+  /*the CPUID result is cached by the compiler runtime, so checking it every time is cheap*/
+  if(len >= 64u) {
+    if(__builtin_cpu_supports("avx2")) return update_adler32_avx2(adler, data, len);
+    if(__builtin_cpu_supports("ssse3")) return update_adler32_ssse3(adler, data, len);
+  }
+#endif /*LODEPNG_ADLER32_SIMD*/
+  return update_adler32_scalar(adler, data, len);
+}
+
 /*Return the adler32 of the bytes data[0..len-1]*/
 static unsigned adler32(const unsigned char* data, unsigned len) {
   return update_adler32(1u, data, len);
 }
 
+unsigned lodepng_update_adler32(unsigned adler, const unsigned char* data, size_t len) {
+  while(len != 0) {
+    unsigned amount = len > 1073741824u ? 1073741824u : (unsigned)len;
+    adler = update_adler32(adler, data, amount);
+    data += amount;
+    len -= amount;
+  }
+  return adler;
+}
+
+unsigned lodepng_adler32_combine(unsigned adler1, unsigned adler2, size_t len2) {
+  /*s1 of the whole is s1(A) + s1(B) - 1, s2 of the whole is s2(A) + s2(B) + len2 * (s1(A) - 1),
+  everything modulo 65521; the added multiples of 65521 keep the intermediate sums unsigned*/
+  unsigned rem = (unsigned)(len2 % 65521u);
+  unsigned s1 = adler1 & 0xffffu;
+  unsigned s2 = (rem * s1) % 65521u;
+  s1 += (adler2 & 0xffffu) + 65521u - 1u;
+  s2 += ((adler1 >> 16u) & 0xffffu) + ((adler2 >> 16u) & 0xffffu) + 65521u - rem;
+  if(s1 >= 65521u) s1 -= 65521u;
+  if(s1 >= 65521u) s1 -= 65521u;
+  if(s2 >= 2u * 65521u) s2 -= 2u * 65521u;
+  if(s2 >= 65521u) s2 -= 65521u;
+  return (s2 << 16u) | s1;
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2338,13 +2711,14 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->match_strategy = LMS_CHAIN;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, LMS_CHAIN, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2415,14 +2789,373 @@ static unsigned lodepng_crc32_table[256] = {
   3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
 };
 
-/*Return the CRC of the bytes buf[0..len-1].*/
-unsigned lodepng_crc32(const unsigned char* data, size_t length) {
-  unsigned r = 0xffffffffu;
+/*
+lodepng_crc32_table extended for slicing-by-8: lodepng_crc32_slices[k - 1][i] is the CRC
+contribution of byte value i followed by k zero bytes, so 8 input bytes can be folded in with
+8 independent table lookups instead of a chain of 8 dependent ones.
+*/
+static const unsigned lodepng_crc32_slices[7][256] = {
+  {
+             0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+    3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+    1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+    2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+    2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+    1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+    3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+     396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+    4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+     950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+    3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+    1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+    1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+    2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+     792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+    3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+     998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+    4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+    1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+    3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+    2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+    1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+    3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+     740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+    3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+      52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+    2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+    1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+    1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+    2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+     347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+    3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+             0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+     236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+     472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+     305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+     944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+     912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+     611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+     712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+    1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+    2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+    1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+    1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+    1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+    1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+    1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+    1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+    3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+    4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+    4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+    4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+    3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+    3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+    3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+    3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+    2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+    2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+    2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+    2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+    2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+    2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+    3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+    3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+             0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+    3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+    1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+    2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+    2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+    1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+    4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+     899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+    2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+    1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+    3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+     247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+     992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+    4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+    1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+    2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+    3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+     686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+    3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+    2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+    1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+    2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+     494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+    3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+    1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+    3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+     643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+    3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+    3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+     332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+    2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+    1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+             0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+     812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+    1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+    1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+    3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+    4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+    2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+    2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+    1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+    1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+     940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+     140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+    2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+    2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+    4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+    3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+    2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+    2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+    3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+    3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+    1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+    1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+     281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+     548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+    3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+    3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+    2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+    3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+     685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+     413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+    1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+    2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+             0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+    3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+      64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+    4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+     128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+    3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+      75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+    3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+     257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+    3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+     210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+    3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+     150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+    3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+     186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+    3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+     514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+    4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+     493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+    4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+     421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+    4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+     449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+    4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+     300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+    4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+     306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+    4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+     373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+    4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+     361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+    4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+             0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+     871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+    1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+    1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+    3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+    4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+    2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+    2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+    1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+    2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+     601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+     272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+    2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+    3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+    3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+    3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+    2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+    3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+    4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+    3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+    1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+    1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+     544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+     328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+    3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+    4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+    2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+    2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+      60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+     810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+    1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+    1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+             0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+    3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+    2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+    2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+    4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+     714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+    2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+    1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+     698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+    4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+    1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+    2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+    3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+      51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+    2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+    2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+    1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+    2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+     796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+    4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+    2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+    2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+    3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+      85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+    2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+    2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+     102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+    3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+    2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+    1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+    4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+     747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
+};
+
+/*bytewise CRC update (without the pre- and post-inversion)*/
+static unsigned crc32_bytewise(unsigned r, const unsigned char* data, size_t length) {
   size_t i;
   for(i = 0; i < length; ++i) {
     r = lodepng_crc32_table[(r ^ data[i]) & 0xffu] ^ (r >> 8u);
   }
-  return r ^ 0xffffffffu;
+  return r;
+}
+
+/*slicing-by-8 CRC update (without the pre- and post-inversion)*/
+static unsigned crc32_slice8(unsigned r, const unsigned char* data, size_t length) {
+  const unsigned (*t)[256] = lodepng_crc32_slices;
+  while(length >= 8) {
+    unsigned lo = r ^ (data[0] | ((unsigned)data[1] << 8u) | ((unsigned)data[2] << 16u) | ((unsigned)data[3] << 24u));
+    unsigned hi = data[4] | ((unsigned)data[5] << 8u) | ((unsigned)data[6] << 16u) | ((unsigned)data[7] << 24u);
+    r = t[6][lo & 0xffu] ^ t[5][(lo >> 8u) & 0xffu] ^ t[4][(lo >> 16u) & 0xffu] ^ t[3][lo >> 24u]
+      ^ t[2][hi & 0xffu] ^ t[1][(hi >> 8u) & 0xffu] ^ t[0][(hi >> 16u) & 0xffu] ^ lodepng_crc32_table[hi >> 24u];
+    data += 8;
+    length -= 8;
+  }
+  return crc32_bytewise(r, data, length);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_CRC32_PCLMUL
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+/*
+CRC update (without the pre- and post-inversion) of a buffer whose length is at least 64 and a
+multiple of 16, by folding 512 bits at a time with carry-less multiplication, from "Fast CRC
+Computation for Generic Polynomials Using PCLMULQDQ Instruction", V. Gopal, E. Ozturk et al.,
+Intel 2009, using the bit-reflected constants given for the CRC-32 polynomial at its end.
+Only call this if the CPU supports PCLMULQDQ.
+*/
+__attribute__((target("sse2,pclmul")))
+static unsigned crc32_pclmul(unsigned r, const unsigned char* data, size_t length) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596ll, 0x0154442bd4ll);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009ell, 0x01751997d0ll);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124ll);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641ll, 0x01db710641ll);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(data + 0));
+  x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+  x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+  x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)r));
+  data += 64;
+  length -= 64;
+
+  /*fold 4 x 128 bits in parallel*/
+  x0 = k1k2;
+  while(length >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 48)));
+    data += 64;
+    length -= 64;
+  }
+
+  /*fold the four into one 128-bit value, then fold in the remaining 16-byte blocks*/
+  x0 = k3k4;
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+  while(length >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+    data += 16;
+    length -= 16;
+  }
+
+  /*fold 128 to 64 bits*/
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /*Barrett reduction to 32 bits*/
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif /*defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))*/
+
+/*Return the CRC of the bytes buf[0..len-1].*/
+unsigned lodepng_crc32(const unsigned char* data, size_t length) {
+  unsigned r = 0xffffffffu;
+#ifdef LODEPNG_CRC32_PCLMUL
+  /*the CPUID result is cached by the compiler runtime, so checking it every time is cheap*/
+  if(length >= 64 && __builtin_cpu_supports("pclmul")) {
+    size_t amount = length & ~(size_t)15u;
+    r = crc32_pclmul(r, data, amount);
+    data += amount;
+    length -= amount;
+  }
+#endif /*LODEPNG_CRC32_PCLMUL*/
+  return crc32_slice8(r, data, length) ^ 0xffffffffu;
 }
 #else /* !LODEPNG_NO_COMPILE_CRC */
 unsigned lodepng_crc32(const unsigned char* data, size_t length);
@@ -5376,6 +6109,203 @@ static unsigned addChunk_iCCP(ucvector* out, const LodePNGInfo* info, LodePNGCom
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_FILTER_SIMD
+#include <immintrin.h>
+
+/*
+SIMD versions of the filters for bytes bytewidth..length-1 of a scanline. When encoding, the
+predictors only use unfiltered bytes, so there is no dependency between the bytes of a scanline and
+any bytewidth vectorizes. Paeth is done on 16-bit lanes, with the same comparisons in the same
+order as paethPredictor. They filter as many whole vectors as fit and return the index of the first
+byte left for the scalar loop. prevline must not be NULL for Up, Average and Paeth. Only call these
+if the CPU has the instruction set in their target attribute.
+*/
+__attribute__((target("sse2")))
+static __m128i paeth_sse2(__m128i a, __m128i b, __m128i c) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i p = _mm_sub_epi16(b, c);
+  __m128i q = _mm_sub_epi16(a, c);
+  __m128i r = _mm_add_epi16(p, q);
+  __m128i pa = _mm_max_epi16(p, _mm_sub_epi16(zero, p));
+  __m128i pb = _mm_max_epi16(q, _mm_sub_epi16(zero, q));
+  __m128i pc = _mm_max_epi16(r, _mm_sub_epi16(zero, r));
+  __m128i mask = _mm_cmplt_epi16(pb, pa);
+  a = _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, a));
+  pa = _mm_min_epi16(pa, pb);
+  mask = _mm_cmplt_epi16(pc, pa);
+  return _mm_or_si128(_mm_and_si128(mask, c), _mm_andnot_si128(mask, a));
+}
+
+__attribute__((target("sse2")))
+static size_t filterScanline_sse2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                  size_t length, size_t bytewidth, unsigned char filterType) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  size_t i;
+  for(i = bytewidth; i + 16u <= length; i += 16u) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+    __m128i b, c, avg, lo, hi;
+    switch(filterType) {
+      case 1: /*Sub*/
+        x = _mm_sub_epi8(x, a);
+        break;
+      case 2: /*Up*/
+        x = _mm_sub_epi8(x, _mm_loadu_si128((const __m128i*)(prevline + i)));
+        break;
+      case 3: /*Average: pavgb rounds up, so take the odd sums' lost bit back off*/
+        b = _mm_loadu_si128((const __m128i*)(prevline + i));
+        avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        x = _mm_sub_epi8(x, avg);
+        break;
+      case 4: /*Paeth*/
+        b = _mm_loadu_si128((const __m128i*)(prevline + i));
+        c = _mm_loadu_si128((const __m128i*)(prevline + i - bytewidth));
+        lo = paeth_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+        hi = paeth_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+        x = _mm_sub_epi8(x, _mm_packus_epi16(lo, hi));
+        break;
+      default: return bytewidth;
+    }
+    _mm_storeu_si128((__m128i*)(out + i), x);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static __m256i paeth_avx2(__m256i a, __m256i b, __m256i c) {
+  __m256i p = _mm256_sub_epi16(b, c);
+  __m256i q = _mm256_sub_epi16(a, c);
+  __m256i pa = _mm256_abs_epi16(p);
+  __m256i pb = _mm256_abs_epi16(q);
+  __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(p, q));
+  a = _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi16(pa, pb));
+  pa = _mm256_min_epi16(pa, pb);
+  return _mm256_blendv_epi8(a, c, _mm256_cmpgt_epi16(pa, pc));
+}
+
+__attribute__((target("avx2")))
+static __m256i load_epu8_epi16(const unsigned char* p) {
+  return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+}
+
+__attribute__((target("avx2")))
+static size_t filterScanline_avx2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                  size_t length, size_t bytewidth, unsigned char filterType) {
+  const __m256i one = _mm256_set1_epi8(1);
+  size_t i;
+  for(i = bytewidth; i + 32u <= length; i += 32u) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i a = _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth));
+    __m256i b, avg, lo, hi;
+    switch(filterType) {
+      case 1: /*Sub*/
+        x = _mm256_sub_epi8(x, a);
+        break;
+      case 2: /*Up*/
+        x = _mm256_sub_epi8(x, _mm256_loadu_si256((const __m256i*)(prevline + i)));
+        break;
+      case 3: /*Average, as in the SSE2 version*/
+        b = _mm256_loadu_si256((const __m256i*)(prevline + i));
+        avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+        x = _mm256_sub_epi8(x, avg);
+        break;
+      case 4: /*Paeth; packus works within 128-bit lanes, so the quadwords are put back in order after*/
+        lo = paeth_avx2(load_epu8_epi16(scanline + i - bytewidth), load_epu8_epi16(prevline + i),
+                        load_epu8_epi16(prevline + i - bytewidth));
+        hi = paeth_avx2(load_epu8_epi16(scanline + i + 16u - bytewidth), load_epu8_epi16(prevline + i + 16u),
+                        load_epu8_epi16(prevline + i + 16u - bytewidth));
+        x = _mm256_sub_epi8(x, _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), _MM_SHUFFLE(3, 1, 2, 0)));
+        break;
+      default: return bytewidth;
+    }
+    _mm256_storeu_si256((__m256i*)(out + i), x);
+  }
+  return i;
+}
+
+/*
+Sums of a filtered scanline for LFS_MINSUM: the bytes as unsigned for filter type 0, otherwise their
+absolute values as signed. For a byte s that is min(s, 255 - s), and 255 - s is ~s.
+*/
+__attribute__((target("sse2")))
+static size_t filterSum_sse2(const unsigned char* filtered, size_t length, unsigned char filterType, size_t* done) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi8(-1);
+  __m128i sum = zero;
+  unsigned long long result;
+  size_t i;
+  for(i = 0; i + 16u <= length; i += 16u) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(filtered + i));
+    if(filterType != 0) x = _mm_min_epu8(x, _mm_xor_si128(x, ones));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(x, zero));
+  }
+  *done = i;
+  sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+  _mm_storel_epi64((__m128i*)&result, sum);
+  return (size_t)result;
+}
+
+__attribute__((target("avx2")))
+static size_t filterSum_avx2(const unsigned char* filtered, size_t length, unsigned char filterType, size_t* done) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi8(-1);
+  __m256i sum = zero;
+  __m128i total;
+  unsigned long long result;
+  size_t i;
+  for(i = 0; i + 32u <= length; i += 32u) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(filtered + i));
+    if(filterType != 0) x = _mm256_min_epu8(x, _mm256_xor_si256(x, ones));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(x, zero));
+  }
+  *done = i;
+  total = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  total = _mm_add_epi64(total, _mm_unpackhi_epi64(total, total));
+  _mm_storel_epi64((__m128i*)&result, total);
+  return (size_t)result;
+}
+#endif /*defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))*/
+
+/*filters what it can of bytes bytewidth..length-1 of the scanline with SIMD, returns the first index left*/
+static size_t filterScanlineSIMD(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t length, size_t bytewidth, unsigned char filterType) {
+#ifdef LODEPNG_FILTER_SIMD
+  if(length >= bytewidth + 16u) {
+    if(__builtin_cpu_supports("avx2")) {
+      return filterScanline_avx2(out, scanline, prevline, length, bytewidth, filterType);
+    }
+    if(__builtin_cpu_supports("sse2")) {
+      return filterScanline_sse2(out, scanline, prevline, length, bytewidth, filterType);
+    }
+  }
+#else /*LODEPNG_FILTER_SIMD*/
+  (void)out; (void)scanline; (void)prevline; (void)length; (void)filterType;
+#endif /*LODEPNG_FILTER_SIMD*/
+  return bytewidth;
+}
+
+/*sum of a filtered scanline as LFS_MINSUM scores it, see filterSum_sse2*/
+static size_t filterSum(const unsigned char* filtered, size_t length, unsigned char filterType) {
+  size_t sum = 0, i = 0;
+#ifdef LODEPNG_FILTER_SIMD
+  if(length >= 16u) {
+    if(__builtin_cpu_supports("avx2")) sum = filterSum_avx2(filtered, length, filterType, &i);
+    else if(__builtin_cpu_supports("sse2")) sum = filterSum_sse2(filtered, length, filterType, &i);
+  }
+#endif /*LODEPNG_FILTER_SIMD*/
+  if(filterType == 0) {
+    for(; i != length; ++i) sum += filtered[i];
+  } else {
+    /*For differences, each byte should be treated as signed, values above 127 are negative
+    (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
+    This means filtertype 0 is almost never chosen, but that is justified.*/
+    for(; i != length; ++i) sum += filtered[i] < 128 ? filtered[i] : (255U - filtered[i]);
+  }
+  return sum;
+}
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType) {
   size_t i;
@@ -5385,11 +6315,14 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       break;
     case 1: /*Sub*/
       for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
+      i = filterScanlineSIMD(out, scanline, prevline, length, bytewidth, filterType);
+      for(; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline) {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - prevline[i];
+        i = filterScanlineSIMD(out, scanline, prevline, length, bytewidth, filterType);
+        for(; i != length; ++i) out[i] = scanline[i] - prevline[i];
       } else {
         for(i = 0; i != length; ++i) out[i] = scanline[i];
       }
@@ -5397,7 +6330,8 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
     case 3: /*Average*/
       if(prevline) {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+        i = filterScanlineSIMD(out, scanline, prevline, length, bytewidth, filterType);
+        for(; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
       } else {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
         for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - (scanline[i - bytewidth] >> 1);
@@ -5407,13 +6341,15 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       if(prevline) {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i) {
+        i = filterScanlineSIMD(out, scanline, prevline, length, bytewidth, filterType);
+        for(; i < length; ++i) {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
       } else {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
         /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]*/
-        for(i = bytewidth; i < length; ++i) out[i] = (scanline[i] - scanline[i - bytewidth]);
+        i = filterScanlineSIMD(out, scanline, prevline, length, bytewidth, 1);
+        for(; i < length; ++i) out[i] = (scanline[i] - scanline[i - bytewidth]);
       }
       break;
     default: return; /*invalid filter type given*/
@@ -5441,8 +6377,9 @@ static size_t ilog2i(size_t i) {
   return i * l + ((i - (1u << l)) << 1u);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+/*filters scanlines y0..y1-1, where scanline y0 - 1 (if any) is the previous line of y0*/
+static unsigned filterRows(unsigned char* out, const unsigned char* in, unsigned w, unsigned y0, unsigned y1,
+                           const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
   /*
   For PNG filter method 0
   out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
@@ -5455,7 +6392,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7u) / 8u;
-  const unsigned char* prevline = 0;
+  const unsigned char* prevline = y0 > 0 ? &in[linebytes * (y0 - 1u)] : 0;
   unsigned x, y;
   unsigned error = 0;
   LodePNGFilterStrategy strategy = settings->filter_strategy;
@@ -5480,7 +6417,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
   if(strategy >= LFS_ZERO && strategy <= LFS_FOUR) {
     unsigned char type = (unsigned char)strategy;
-    for(y = 0; y != h; ++y) {
+    for(y = y0; y != y1; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       out[outindex] = type; /*filter type byte*/
@@ -5488,52 +6425,34 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       prevline = &in[inindex];
     }
   } else if(strategy == LFS_MINSUM) {
-    /*adaptive filtering*/
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
+    /*adaptive filtering. Each attempt is made in the output scanline itself, and the best filter is applied
+    again at the end unless it was the last one tried, which is cheaper than allocating and copying attempts*/
     size_t smallest = 0;
     unsigned char type, bestType = 0;
 
-    for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) error = 83; /*alloc fail*/
-    }
+    for(y = y0; y != y1; ++y) {
+      unsigned char* line = &out[y * (linebytes + 1) + 1];
+      /*try the 5 filter types*/
+      for(type = 0; type != 5; ++type) {
+        size_t sum;
+        filterScanline(line, &in[y * linebytes], prevline, linebytes, bytewidth, type);
 
-    if(!error) {
-      for(y = 0; y != h; ++y) {
-        /*try the 5 filter types*/
-        for(type = 0; type != 5; ++type) {
-          size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          if(type == 0) {
-            for(x = 0; x != linebytes; ++x) sum += (unsigned char)(attempt[type][x]);
-          } else {
-            for(x = 0; x != linebytes; ++x) {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum += s < 128 ? s : (255U - s);
-            }
-          }
+        /*calculate the sum of the result*/
+        sum = filterSum(line, linebytes, type);
 
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum < smallest) {
-            bestType = type;
-            smallest = sum;
-          }
+        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+        if(type == 0 || sum < smallest) {
+          bestType = type;
+          smallest = sum;
         }
+      }
 
-        prevline = &in[y * linebytes];
+      /*now fill the out values*/
+      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+      if(bestType != 4) filterScanline(line, &in[y * linebytes], prevline, linebytes, bytewidth, bestType);
 
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
-      }
+      prevline = &in[y * linebytes];
     }
-
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   } else if(strategy == LFS_ENTROPY) {
     unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t bestSum = 0;
@@ -5546,7 +6465,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
+      for(y = y0; y != y1; ++y) {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type) {
           size_t sum = 0;
@@ -5574,7 +6493,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
     for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   } else if(strategy == LFS_PREDEFINED) {
-    for(y = 0; y != h; ++y) {
+    for(y = y0; y != y1; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       unsigned char type = settings->predefined_filters[y];
@@ -5607,7 +6526,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
     if(!error) {
-      for(y = 0; y != h; ++y) /*try the 5 filter types*/ {
+      for(y = y0; y != y1; ++y) /*try the 5 filter types*/ {
         for(type = 0; type != 5; ++type) {
           unsigned testsize = (unsigned)linebytes;
           /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
@@ -5635,6 +6554,16 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   return error;
 }
 
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  return filterRows(out, in, w, 0, h, color, settings);
+}
+
+unsigned lodepng_filter_rows(unsigned char* out, const unsigned char* in, unsigned w, unsigned y0, unsigned y1,
+                             const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  return filterRows(out, in, w, y0, y1, color, settings);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h) {
   /*The opposite of the removePaddingBits function
@@ -6258,6 +7187,7 @@ const char* lodepng_error_text(unsigned code) {
     /*max ICC size limit can be configured in LodePNGDecoderSettings. This error prevents
     unreasonable memory consumption when decoding due to impossibly large ICC profile*/
     case 113: return "ICC profile unreasonably large";
+    case 114: return "invalid match strategy given for LodePNGCompressSettings.match_strategy";
   }
   return "unknown error code";
 }
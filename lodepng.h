@@ -297,6 +297,17 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/*How deflate searches for LZ77 matches, trading compression for speed. Default: LMS_CHAIN*/
+typedef enum LodePNGMatchStrategy {
+  /*walk the hash chains (up to the window size) with optional lazy matching: best compression*/
+  LMS_CHAIN = 0,
+  /*probe only the latest earlier position with the same hash and take any match greedily,
+  like zlib's level 1: several times faster, somewhat larger output*/
+  LMS_GREEDY = 1,
+  /*only look for runs of the previous byte (distance 1), like zlib's Z_RLE: fastest*/
+  LMS_RLE = 2
+} LodePNGMatchStrategy;
+
 /*
 Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
@@ -310,6 +321,7 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
   unsigned minmatch; /*minimum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  LodePNGMatchStrategy match_strategy; /*how to search for matches if use_lz77. Default: LMS_CHAIN*/
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -757,6 +769,18 @@ typedef struct LodePNGEncoderSettings {
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
+
+/*
+Applies the filter step of the encoder (using settings->filter_strategy) to
+scanlines y0..y1-1 only. in holds the padded scanlines of the
+whole image (or Adam7 pass) of width w, out receives each filtered scanline with
+its filter type byte in front, at the same place as for the whole image. Each
+scanline depends only on itself and the one before it, so disjoint bands of
+scanlines can be filtered concurrently, giving output identical to filtering
+the whole image at once.
+*/
+unsigned lodepng_filter_rows(unsigned char* out, const unsigned char* in, unsigned w, unsigned y0, unsigned y1,
+                             const LodePNGColorMode* color, const LodePNGEncoderSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 
@@ -924,6 +948,13 @@ buffer. It cannot be used to create gzip files however, and it only supports the
 part of zlib that is required for PNG, it does not support dictionaries.
 */
 
+/*Update the Adler-32 checksum of the zlib trailer with data. Start with adler 1.*/
+unsigned lodepng_update_adler32(unsigned adler, const unsigned char* data, size_t len);
+
+/*Adler-32 of A followed by B, from the Adler-32 of A, that of B and the length of B, without
+rescanning the data, so parts checksummed separately (e.g. in parallel) can be merged.*/
+unsigned lodepng_adler32_combine(unsigned adler1, unsigned adler2, size_t len2);
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Inflate a buffer. Inflate is the decompression step of deflate. Out buffer must be freed after use.*/
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
@@ -965,6 +996,41 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings);
 
+/*
+Compress in[start..end) as one part of a larger deflate stream, e.g. to split
+the work across threads. The up to windowsize bytes before start are used as
+the dictionary, so matches can reach back into the previous part. Unless final
+is set, the output ends with an empty stored block (a "sync flush") so it ends
+on a byte boundary and the next part can be appended directly. Concatenating
+the parts of a whole buffer, with final set only on the last, gives a valid
+deflate stream. Out buffer must be freed after use.
+*/
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t start, size_t end, unsigned final,
+                              const LodePNGCompressSettings* settings);
+
+/*
+The memory deflate needs besides its output: the LZ77 hash chains and symbols,
+the Huffman trees and the scratch memory to build them, kept from call to call
+to avoid allocating and initializing it for every part. Only one thread at a
+time may use a context.
+*/
+typedef struct LodePNGDeflateContext LodePNGDeflateContext;
+
+/*Returns a new context, or NULL if out of memory.*/
+LodePNGDeflateContext* lodepng_deflate_context_new(void);
+void lodepng_deflate_context_delete(LodePNGDeflateContext* context);
+
+/*
+As lodepng_deflate_part, but using the memory of context, which also holds the
+output: *out is valid until the next call with the same context and must not be
+freed. After the first parts, further parts of no larger size and compressed
+size with the same settings cause no allocations.
+*/
+unsigned lodepng_deflate_part_reuse(LodePNGDeflateContext* context, const unsigned char** out, size_t* outsize,
+                                    const unsigned char* in, size_t start, size_t end, unsigned final,
+                                    const LodePNGCompressSettings* settings);
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
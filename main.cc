@@ -1,34 +1,57 @@
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
 #include <limits>
-#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <thread>
-#include <unordered_map>
 #include <vector>
 
 #include "lodepng.h"
 
 using std::array;
+using std::atomic;
 using std::cerr;
+using std::condition_variable;
 using std::cout;
 using std::endl;
 using std::flush;
 using std::getenv;
-using std::map;
+using std::lock_guard;
+using std::mutex;
 using std::numeric_limits;
 using std::ofstream;
 using std::ostream;
 using std::string;
 using std::stringstream;
 using std::thread;
-using std::unordered_map;
+using std::unique_lock;
+using std::unique_ptr;
 using std::vector;
 
 #ifndef NDEBUG
@@ -38,11 +61,33 @@ using std::vector;
 #define P(x) x
 #endif
 
+#ifndef LODEPNG_COMPILE_ALLOCATORS
+// Built with -DLODEPNG_NO_COMPILE_ALLOCATORS, lodepng allocates through these,
+// which count its allocations to be reported after each frame
+static atomic<size_t> lodepngAllocations{0};
+
+void *lodepng_malloc(size_t size) {
+  ++lodepngAllocations;
+  return malloc(size);
+}
+
+void *lodepng_realloc(void *ptr, size_t size) {
+  ++lodepngAllocations;
+  return realloc(ptr, size);
+}
+
+void lodepng_free(void *ptr) { free(ptr); }
+#endif
+
 namespace {
 
 constexpr int INT_MIN = numeric_limits<int>::min();
 constexpr int INT_MAX = numeric_limits<int>::max();
 
+/** PNG compression profiles, trading file size against encoding time. */
+enum class Compression { FAST, BALANCED, MAX };
+enum class Format { PNG, QOI, JPEG, Y4M, RGB, GIF, APNG, DZI };
+
 template <typename T>
 struct Params {
   int HD_IMG_WIDTH = 1400;
@@ -52,6 +97,27 @@ struct Params {
   T width = 0.2;
   int maxIterationCount = 10000;
   const char *outputFileName = "mandelbrot.png";
+  Format format = Format::PNG;  // from -f or the outputFileName extension
+  bool bounce = false;  // repeat the frames backwards, for GIF and APNG
+  Compression compression = Compression::BALANCED;
+  bool palette = false;  // 8-bit palette indices instead of RGB
+  // If set, where to also save the iteration counts, compressed if the name
+  // ends in .iterz
+  const char *iterationsFileName = nullptr;
+  // If set, an iteration file whose counts and view are coloured instead of
+  // computing them
+  const char *recolorFileName = nullptr;
+  // If set, the directory of cached reference orbits for deep views
+  const char *orbitCacheDir = nullptr;
+  // Hill-shading light source, in degrees above the horizon and clockwise
+  // from north, and vertical exaggeration of the iteration-count surface
+  double altitude = 45;
+  double azimuth = 135;
+  double zFactor = 1;
+  // Hue, in degrees, of the lowest iteration counts, and the hues swept
+  // through up to the highest
+  double hue = 0;
+  double hueSpan = 250;
 };
 template <typename T>
 ostream &operator<<(ostream &out, const Params<T> &p) {
@@ -63,9 +129,67 @@ ostream &operator<<(ostream &out, const Params<T> &p) {
   return out;
 }
 
+/**
+ * Array over non-negative indices stored as fixed-size pages that are only
+ * allocated (zero-initialized) when first written, so a sparse spread of
+ * indices over a 10^7 range stays compact while every lookup is still plain
+ * array indexing.
+ */
+template <typename V>
+class PagedArray {
+  static constexpr int PAGE_BITS = 12;
+  static constexpr int PAGE_SIZE = 1 << PAGE_BITS;
+  static constexpr int PAGE_MASK = PAGE_SIZE - 1;
+
+  vector<unique_ptr<V[]>> _pages;
+
+ public:
+  /** Writable element, allocating its page if necessary. */
+  V &operator[](int i) {
+    assert(i >= 0);
+    const size_t page = i >> PAGE_BITS;
+    if (page >= _pages.size()) _pages.resize(page + 1);
+    if (!_pages[page]) _pages[page].reset(new V[PAGE_SIZE]());
+    return _pages[page][i & PAGE_MASK];
+  }
+
+  /** Element i, which must have been written. */
+  const V &at(int i) const { return _pages[i >> PAGE_BITS][i & PAGE_MASK]; }
+
+  /** Element i, or V() if it was never written. */
+  V get(int i) const {
+    const size_t page = i >> PAGE_BITS;
+    if (page >= _pages.size() || !_pages[page]) return V();
+    return _pages[page][i & PAGE_MASK];
+  }
+
+  /** Next index >= i that might have been written. */
+  int skip(int i) const {
+    const size_t page = i >> PAGE_BITS;
+    if (page < _pages.size() && _pages[page]) return i;
+    return (i | PAGE_MASK) + 1;
+  }
+
+  void clear() { _pages.clear(); }
+
+  PagedArray &operator+=(const PagedArray &other) {
+    if (other._pages.size() > _pages.size()) _pages.resize(other._pages.size());
+    for (size_t page = 0; page < other._pages.size(); ++page) {
+      if (!other._pages[page]) continue;
+      if (!_pages[page]) _pages[page].reset(new V[PAGE_SIZE]());
+      for (int j = 0; j < PAGE_SIZE; ++j) {
+        _pages[page][j] += other._pages[page][j];
+      }
+    }
+    return *this;
+  }
+};
+
 class Stats {
-  map<int, int> _histogram;
-  unordered_map<int, double> _itersToPercentile;
+  PagedArray<int> _histogram;
+  // Indexed by mapped() iteration count, filled by preparePercentile() with
+  // the running (prefix-sum) percentile.
+  PagedArray<double> _itersToPercentile;
 
   int _totalCount = 0;
   int _min = INT_MAX;
@@ -75,32 +199,40 @@ class Stats {
   void operator()(int i) {
     if (i > _max) _max = i;
     if (i < _min) _min = i;
-    auto lookup = _histogram.find(i);
-    int prev = lookup == _histogram.end() ? 0 : lookup->second;
-    _histogram[i] = prev + 1;
+    ++_histogram[i];
     ++_totalCount;
   }
+  Stats &operator+=(const Stats &other) {
+    if (other._totalCount == 0) return *this;
+    if (other._max > _max) _max = other._max;
+    if (other._min < _min) _min = other._min;
+    _histogram += other._histogram;
+    _totalCount += other._totalCount;
+    return *this;
+  }
+  /** Calls f(iterations, count) for every iteration count seen, in order. */
+  template <typename F>
+  void forEach(F f) const {
+    for (int i = _histogram.skip(_min); i <= _max; i = _histogram.skip(i + 1)) {
+      const int n = _histogram.get(i);
+      if (n != 0) f(i, n);
+    }
+  }
   void preparePercentile() {
+    _itersToPercentile.clear();
     double acc = 0;
-    for (auto const &pair : _histogram) {
-      _itersToPercentile[pair.first] = (acc + pair.second / 2) / _totalCount;
-      acc += pair.second;
-    }
+    forEach([&](int i, int n) {
+      _itersToPercentile[mapped(i)] = (acc + n / 2) / _totalCount;
+      acc += n;
+    });
   }
-  double normalize(int i) const { return 1.0 * (i - _min) / (_max - _min); }
-  double percentile(int i) const { return _itersToPercentile.at(i); }
+  double percentile(int i) const { return _itersToPercentile.at(mapped(i)); }
   int mapped(int iterations) const { return iterations - _min; }
   int range() const { return _max - _min; }
-  friend ostream &operator<<(ostream &, const Stats &);
 };
 ostream &operator<<(ostream &out, const Stats &s) {
   out << "Iterations,Count\n";
-  for (int i = s._min; i <= s._max; ++i) {
-    auto lookup = s._histogram.find(i);
-    if (lookup != s._histogram.end()) {
-      out << i << "," << lookup->second << "\n";
-    }
-  }
+  s.forEach([&](int i, int n) { out << i << "," << n << "\n"; });
   return out;
 }
 
@@ -110,297 +242,3670 @@ void addText(lodepng::State *state, const char *key, const string &value) {
   if (err) throw err;
 }
 
-// hill-shading parameters
-constexpr double Z_FACTOR = 1;
-constexpr double KERNELSIZE = 1;
-constexpr double ALTITUDE = 45 * M_PI / 180;
-constexpr double AZIMUTH = 135 * M_PI / 180;
+int threadCount = thread::hardware_concurrency();
 
-// Derived hill-shading values
-constexpr double ZENITH = M_PI / 2 - ALTITUDE;
+/** Calls f(i) for each i in [0, count), spread over threadCount threads. */
+template <typename F>
+void parallelFor(size_t count, F f) {
+  atomic<size_t> next{0};
+  auto worker = [&] {
+    for (size_t i; (i = next++) < count;) {
+      f(i);
+    }
+  };
+  vector<thread> threads;
+  for (size_t t = 1; t < std::min<size_t>(threadCount, count); ++t) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
 
-class Image {
-  const int _width;
-  const int _height;
-  vector<int> _iterations;
-  unsigned char *const _pixels;
+// Size of the pieces the PNG image data is cut into for parallel deflate
+constexpr size_t DEFLATE_PART_SIZE = 1 << 18;
 
- public:
-  Image(int width, int height)
-      : _width(width),
-        _height(height),
-        _iterations(width * height),
-        _pixels(new unsigned char[width * height * 4]) {}
-  ~Image() { delete[] _pixels; }
-  // Optimized for ix changing faster
-  int &iterations(int ix, int iy) { return _iterations[ix + _width * iy]; }
+// Number of scanlines per task when filtering in parallel
+constexpr unsigned FILTER_BAND = 16;
 
-  unsigned char &pixel(int ix, int iy, int layer) {
-    return _pixels[4 * ix + 4 * _width * iy + layer];
+/**
+ * Applies lodepng's filter step to the h scanlines of in, like lodepng's own
+ * but in bands through lodepng_filter_rows. Each scanline's filter choice
+ * only depends on its own and the previous raw scanline, so bands of
+ * scanlines are filtered on all cores with output identical to the serial
+ * filter.
+ */
+unsigned parallelFilter(unsigned char *out, const unsigned char *in,
+                        unsigned w, unsigned h, const LodePNGColorMode *color,
+                        const LodePNGEncoderSettings *settings) {
+  const size_t bands = (h + FILTER_BAND - 1) / FILTER_BAND;
+  vector<unsigned> errors(bands, 0);
+  parallelFor(bands, [&](size_t i) {
+    const unsigned y0 = i * FILTER_BAND;
+    const unsigned y1 = std::min(y0 + FILTER_BAND, h);
+    errors[i] = lodepng_filter_rows(out, in, w, y0, y1, color, settings);
+  });
+  for (unsigned error : errors) {
+    if (error) return error;
   }
+  return 0;
+}
 
-  int centerIterations() { return iterations(_width / 2, _height / 2); }
-
-  /** https://pro.arcgis.com/en/pro-app/latest/tool-reference/3d-analyst/how-hillshade-works.htm
-   * https://blog.datawrapper.de/shaded-relief-with-gdal-python/
-   */
-  double hillshade(int ix, int iy) {
-    // Values in the eight neighboring cells
-    const double a = iterations(ix - 1, iy - 1);
-    const double b = iterations(ix, iy - 1);
-    const double c = iterations(ix + 1, iy - 1);
-    const double d = iterations(ix - 1, iy);
-    const double f = iterations(ix + 1, iy);
-    const double g = iterations(ix - 1, iy + 1);
-    const double h = iterations(ix, iy + 1);
-    const double i = iterations(ix + 1, iy + 1);
+/**
+ * pigz-style deflate on all cores: the input is cut into parts, each using
+ * the window before it (reaching back before start too) as dictionary and
+ * ending in a sync flush, and the parts are appended to the output in order.
+ * Only the last part of a final call ends the deflate stream. The deflate
+ * contexts and part buffers are kept from call to call, so once the first
+ * batch or frame has sized them, the rest make no lodepng allocations.
+ */
+class ParallelDeflater {
+  struct ContextDeleter {
+    void operator()(LodePNGDeflateContext *context) const {
+      lodepng_deflate_context_delete(context);
+    }
+  };
+  using Context = unique_ptr<LodePNGDeflateContext, ContextDeleter>;
 
-    const double dzdx = ((c + 2 * f + i) - (a + 2 * d + g)) / (8 * KERNELSIZE);
-    const double dzdy = ((g + 2 * h + i) - (a + 2 * b + c)) / (8 * KERNELSIZE);
+  mutex _mutex;
+  // Contexts not in use by a part, at most one per thread in the end
+  vector<Context> _idle;
+  vector<vector<unsigned char>> _parts;
+  vector<unsigned> _adlers;
+  vector<unsigned> _errors;
 
-    const double slope = atan(Z_FACTOR * sqrt(dzdx * dzdx + dzdy * dzdy));
+  Context take() {
+    lock_guard<mutex> lock(_mutex);
+    if (_idle.empty()) return Context(lodepng_deflate_context_new());
+    Context context = std::move(_idle.back());
+    _idle.pop_back();
+    return context;
+  }
 
-    const double aspect = atan2(dzdy, -dzdx);
-    double shade = ((cos(ZENITH) * cos(slope)) +
-                    (sin(ZENITH) * sin(slope) * cos(AZIMUTH - aspect)));
-    return shade < 0 ? 0 : shade;
+  void give(Context context) {
+    lock_guard<mutex> lock(_mutex);
+    _idle.push_back(std::move(context));
   }
 
-  template <typename T>
-  bool writePng(const Params<T> &params) const {
-    try {
-      lodepng::State state;
-      lodepng_info_init(&state.info_png);
-
-      stringstream titleStream;
-      titleStream << "Mandelbrot Set At (" << params.centerRe << ","
-                  << params.centerIm << ")";
-      const string title = titleStream.str();
-      addText(&state, "Title", title);
-
-      const char *maybeAuthor = getenv("USER");
-      if (maybeAuthor) {
-        const string author = maybeAuthor;
-        addText(&state, "Author", author);
-      }
-
-      stringstream descriptionStream;
-      descriptionStream << "\n\nThis is a view of the Mandelbrot set that is "
-                        << params.width
-                        << " wide,\ncalculated with a maximum of "
-                        << params.maxIterationCount << " iterations per pixel.";
-      const string description = descriptionStream.str();
-      addText(&state, "Description", description);
-
-      // TODO(eob) Allow creator name to be parameterized to be someone other
-      // than me.
-      const string copyright =
-          " by Eamonn O'Brien-Strain, licensed under CC "
-          "BY-NC-SA 4.0. To view a copy of this license, visit "
-          "https://creativecommons.org/licenses/by-nc-sa/4.0";
-      addText(&state, "Copyright", title + " " + copyright);
-
-      const string software =
-          "Almond Bread (https://github.com/eobrain/almondbread)";
-      addText(&state, "Software", software);
-
-      char hostname[100];
-      if (gethostname(hostname, (sizeof hostname) - 1) != 0) {
-        strcpy(hostname, "(unknown host}");
-      }
-      addText(&state, "Source", hostname);
-
-      if (maybeAuthor) {
-        addText(&state, "Comment",
-                title + "\nCopyright " + copyright + "\nCreated by " +
-                    maybeAuthor + "@" + hostname + " using " + software +
-                    ".\n" + description);
-      } else {
-        addText(&state, "Comment",
-                title + "\nCopyright " + copyright + "\nCreated on " +
-                    hostname + " using " + software + ".\n" + description);
-      }
+ public:
+  /**
+   * Appends the deflated in[start, end) to out, extending the running
+   * Adler-32 adler over it from the per-part checksums.
+   */
+  unsigned deflate(vector<unsigned char> *out, unsigned *adler,
+                   const unsigned char *in, size_t start, size_t end,
+                   bool final, const LodePNGCompressSettings *settings) {
+    const size_t partCount = std::max<size_t>(
+        1, (end - start + DEFLATE_PART_SIZE - 1) / DEFLATE_PART_SIZE);
+    auto partStart = [&](size_t i) {
+      return std::min(start + i * DEFLATE_PART_SIZE, end);
+    };
+    // Never shrunk, to keep the capacity of the part buffers
+    if (_parts.size() < partCount) _parts.resize(partCount);
+    _adlers.assign(partCount, 1);
+    _errors.assign(partCount, 0);
 
-      vector<unsigned char> png;
-      unsigned err = lodepng::encode(png, _pixels, params.HD_IMG_WIDTH,
-                                     params.HD_IMG_HEIGHT, state);
-      if (err) throw err;
+    parallelFor(partCount, [&](size_t i) {
+      const size_t from = partStart(i);
+      const size_t to = partStart(i + 1);
+      Context context = take();
+      if (!context) {
+        _errors[i] = 83;  // lodepng's out of memory error
+        return;
+      }
+      const unsigned char *part = nullptr;
+      size_t partSize = 0;
+      _errors[i] = lodepng_deflate_part_reuse(
+          context.get(), &part, &partSize, in, from, to,
+          final && i == partCount - 1, settings);
+      if (!_errors[i]) _parts[i].assign(part, part + partSize);
+      give(std::move(context));
+      _adlers[i] = lodepng_update_adler32(1, in + from, to - from);
+    });
 
-      lodepng::save_file(png, params.outputFileName);
-    } catch (unsigned err) {
-      cerr << "encoder error " << err << ": " << lodepng_error_text(err)
-           << endl;
-      return false;
+    for (size_t i = 0; i < partCount; ++i) {
+      if (_errors[i]) return _errors[i];
+      out->insert(out->end(), _parts[i].begin(), _parts[i].end());
+      *adler = lodepng_adler32_combine(*adler, _adlers[i],
+                                       partStart(i + 1) - partStart(i));
     }
-    return true;
+    return 0;
   }
 };
 
-array<double, 3> hsv2rgb(double h, double s, double v) {
-  double c = v * s;
-  double x = c * (1.0 - fabs(fmod(h / 60.0, 2) - 1.0));
-  double m = v - c;
-  if (h >= 0.0 && h < 60.0) {
-    return {c + m, x + m, m};
+void setCompression(Compression compression, LodePNGEncoderSettings *settings) {
+  LodePNGCompressSettings &zlib = settings->zlibsettings;
+  switch (compression) {
+    case Compression::FAST:
+      // Paeth leaves mostly runs of zeros, which RLE alone catches cheaply
+      settings->filter_strategy = LFS_FOUR;
+      zlib.match_strategy = LMS_RLE;
+      break;
+    case Compression::BALANCED:
+      settings->filter_strategy = LFS_FOUR;
+      zlib.match_strategy = LMS_GREEDY;
+      zlib.windowsize = 32768;
+      break;
+    case Compression::MAX:
+      settings->filter_strategy = LFS_MINSUM;
+      zlib.match_strategy = LMS_CHAIN;
+      zlib.windowsize = 32768;
+      zlib.nicematch = 258;
+      zlib.lazymatching = 1;
+      break;
   }
-  if (h >= 60.0 && h < 120.0) {
-    return {x + m, c + m, m};
+}
+
+/** Parses a format name as used by -f, returning false if unknown. */
+bool parseFormat(const char *name, Format *format) {
+  static const struct {
+    const char *name;
+    Format format;
+  } FORMATS[] = {{"png", Format::PNG},
+                 {"qoi", Format::QOI},
+                 {"jpg", Format::JPEG},
+                 {"jpeg", Format::JPEG},
+                 {"y4m", Format::Y4M},
+                 {"rgb", Format::RGB},
+                 {"gif", Format::GIF},
+                 {"apng", Format::APNG},
+                 {"dzi", Format::DZI}};
+  for (const auto &f : FORMATS) {
+    if (strcmp(name, f.name) == 0) {
+      *format = f.format;
+      return true;
+    }
   }
-  if (h >= 120.0 && h < 180.0) {
-    return {m, c + m, x + m};
+  return false;
+}
+
+/** Output format chosen by the extension of fileName, PNG by default. */
+Format formatOf(const char *fileName) {
+  const char *extension = strrchr(fileName, '.');
+  Format format = Format::PNG;
+  if (extension) parseFormat(extension + 1, &format);
+  return format;
+}
+
+/** Whether the format holds a sequence of frames rather than one image. */
+bool isSequence(Format format) {
+  return format == Format::Y4M || format == Format::RGB ||
+         format == Format::GIF || format == Format::APNG;
+}
+
+/**
+ * Parses comma-separated numbers into the first of values, leaving the rest
+ * unchanged, returning false unless text is one to values.size() numbers.
+ */
+bool parseNumbers(const char *text, std::initializer_list<double *> values) {
+  for (double *value : values) {
+    char *end;
+    *value = strtod(text, &end);
+    if (end == text) return false;
+    if (*end == '\0') return true;
+    if (*end != ',') return false;
+    text = end + 1;
   }
-  if (h >= 180.0 && h < 240.0) {
-    return {m, x + m, c + m};
+  return false;
+}
+
+// Bytes OutputFile gathers before each write(2)
+constexpr size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+
+/**
+ * The output file, or stdout if its name is "-", that encoders write to
+ * through a large buffer. A regular file is written under another name and
+ * only renamed to its own by close, so that a reader never sees it half
+ * written and a failed render leaves nothing behind. Where the system has
+ * O_TMPFILE the file has no name at all until then, so not even a killed
+ * process leaves one. Anything else, such as a pipe or device, is written in
+ * place. Errors are thrown as lodepng error 79.
+ */
+class OutputFile {
+  const string _fileName;
+  const bool _stdout;
+  bool _inPlace = false;
+  string _tempName;  // empty while the file is unnamed
+  int _fd = -1;
+  vector<unsigned char> _buffer;
+
+  /** Opens a file in the directory of the output file, not yet in place. */
+  void openTemporary() {
+    const size_t slash = _fileName.rfind('/');
+    const string directory =
+        slash == string::npos ? "." : _fileName.substr(0, slash + 1);
+#ifdef O_TMPFILE
+    _fd = open(directory.c_str(), O_TMPFILE | O_WRONLY, 0666);
+    if (_fd >= 0) return;
+    // Otherwise the file system does not support it
+#endif
+    _tempName = _fileName + ".XXXXXX";
+    _fd = mkstemp(&_tempName[0]);
+    if (_fd < 0) throw 79u;  // failed to open file for writing
+    // mkstemp makes the file private, where open would have applied umask
+    const mode_t mask = umask(0);
+    umask(mask);
+    if (fchmod(_fd, 0666 & ~mask) != 0) throw 79u;
   }
-  if (h >= 240.0 && h < 300.0) {
-    return {x + m, m, c + m};
+
+  void flush() {
+    const unsigned char *data = _buffer.data();
+    size_t size = _buffer.size();
+    _buffer.clear();
+    writeFully(data, size);
   }
-  if (h >= 300.0 && h < 360.0) {
-    return {c + m, m, x + m};
+
+  void writeFully(const unsigned char *data, size_t size) {
+    while (size > 0) {
+      const ssize_t n = ::write(_fd, data, size);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) throw 79u;
+      data += n;
+      size -= n;
+    }
   }
-  return {m, m, m};
-}
 
-constexpr unsigned char clamp(int color) { return color >= 255 ? 255 : color; }
+ public:
+  explicit OutputFile(const char *fileName)
+      : _fileName(fileName), _stdout(_fileName == "-") {
+    _buffer.reserve(OUTPUT_BUFFER_SIZE);
+    struct stat status;
+    if (_stdout) {
+      _fd = STDOUT_FILENO;
+    } else if (stat(fileName, &status) == 0 && !S_ISREG(status.st_mode)) {
+      _inPlace = true;
+      _fd = open(fileName, O_WRONLY | O_TRUNC);
+      if (_fd < 0) throw 79u;
+    } else {
+      openTemporary();
+    }
+  }
+  ~OutputFile() {
+    if (_fd < 0 || _stdout) return;
+    ::close(_fd);
+    if (!_tempName.empty()) unlink(_tempName.c_str());
+  }
+  OutputFile(const OutputFile &) = delete;
+  OutputFile &operator=(const OutputFile &) = delete;
 
-template <typename T>
-int iterations(int maxIterationCount, T cRe, T cIm) {
-  T zRe = 0;
-  T zIm = 0;
-  T zRe2 = 0;
-  T zIm2 = 0;
-  for (int i = 0; i < maxIterationCount; ++i) {
-    T zReNew = zRe2 - zIm2 + cRe;
-    T zImNew = 2 * zRe * zIm + cIm;
-    zRe2 = zReNew * zReNew;
-    zIm2 = zImNew * zImNew;
-    if (zRe2 + zIm2 > 4) {
-      return i;
+  void write(const unsigned char *data, size_t size) {
+    if (_buffer.size() + size > OUTPUT_BUFFER_SIZE) flush();
+    if (size >= OUTPUT_BUFFER_SIZE) {
+      writeFully(data, size);
+    } else {
+      _buffer.insert(_buffer.end(), data, data + size);
     }
-    zRe = zReNew;
-    zIm = zImNew;
   }
-  return maxIterationCount;
-}
 
+  /**
+   * Writes out what is buffered and puts the file in place, replacing any
+   * file of that name, reporting errors such as a full disk.
+   */
+  void close() {
+    flush();
+    if (_stdout) return;
+    if (_inPlace) {
+      const int fd = _fd;
+      _fd = -1;
+      if (::close(fd) != 0) throw 79u;
+      return;
+    }
+    if (_tempName.empty()) {
+      // Link the unnamed file under a name of this process's first, since
+      // linkat cannot replace an existing file, clearing any left by a
+      // process that had the same id
+      stringstream procPath;
+      procPath << "/proc/self/fd/" << _fd;
+      stringstream tempName;
+      tempName << _fileName << "." << getpid() << ".tmp";
+      unlink(tempName.str().c_str());
+      if (linkat(AT_FDCWD, procPath.str().c_str(), AT_FDCWD,
+                 tempName.str().c_str(), AT_SYMLINK_FOLLOW) != 0) {
+        throw 79u;
+      }
+      _tempName = tempName.str();
+    }
+    const int fd = _fd;
+    _fd = -1;
+    const bool closed = ::close(fd) == 0;
+    if (!closed || rename(_tempName.c_str(), _fileName.c_str()) != 0) {
+      unlink(_tempName.c_str());
+      throw 79u;
+    }
+  }
+};
+
+/**
+ * Sets up state to encode RGB pixels, or palette indices into palette if it
+ * is not empty, with the metadata and compression of params. Errors are
+ * thrown as lodepng error codes.
+ */
 template <typename T>
-int iterations(const Params<T> &params, int ix, int iy) {
-  T scale = params.width / params.HD_IMG_WIDTH;
-  T cRe = scale * (ix - params.HD_IMG_WIDTH / 2) + params.centerRe;
-  T cIm = scale * (params.HD_IMG_HEIGHT / 2 - iy) + params.centerIm;
-  return iterations(params.maxIterationCount, cRe, cIm);
-}
+void initPngState(const Params<T> &params,
+                  const vector<array<unsigned char, 3>> &palette,
+                  lodepng::State *state) {
+  lodepng_info_init(&state->info_png);
 
-const int COLOR_SCALE = 10;
+  stringstream titleStream;
+  titleStream << "Mandelbrot Set At (" << params.centerRe << ","
+              << params.centerIm << ")";
+  const string title = titleStream.str();
+  addText(state, "Title", title);
 
-void setColor(const Stats &stats, Image *img, int maxIterationCount, int ix,
-              int iy, double shade) {
-  int iters = img->iterations(ix, iy);
-  if (iters == maxIterationCount) {
-    img->pixel(ix, iy, 0) = 0;
-    img->pixel(ix, iy, 1) = 0;
-    img->pixel(ix, iy, 2) = 0;
-    img->pixel(ix, iy, 3) = 255;
-    return;
+  const char *maybeAuthor = getenv("USER");
+  if (maybeAuthor) {
+    const string author = maybeAuthor;
+    addText(state, "Author", author);
   }
 
-  double value = stats.percentile(iters);
-  value *= value;
-  auto rgb = hsv2rgb(250 * value, (1 - 3 * value / 4) / 2, (2 + shade) / 3);
-  for (int i = 0; i < 3; ++i) {
-    img->pixel(ix, iy, i) = rgb[i] * 256;
+  stringstream descriptionStream;
+  descriptionStream << "\n\nThis is a view of the Mandelbrot set that is "
+                    << params.width
+                    << " wide,\ncalculated with a maximum of "
+                    << params.maxIterationCount << " iterations per pixel.";
+  const string description = descriptionStream.str();
+  addText(state, "Description", description);
+
+  // TODO(eob) Allow creator name to be parameterized to be someone other
+  // than me.
+  const string copyright =
+      " by Eamonn O'Brien-Strain, licensed under CC "
+      "BY-NC-SA 4.0. To view a copy of this license, visit "
+      "https://creativecommons.org/licenses/by-nc-sa/4.0";
+  addText(state, "Copyright", title + " " + copyright);
+
+  const string software =
+      "Almond Bread (https://github.com/eobrain/almondbread)";
+  addText(state, "Software", software);
+
+  char hostname[100];
+  if (gethostname(hostname, (sizeof hostname) - 1) != 0) {
+    strcpy(hostname, "(unknown host}");
   }
-  img->pixel(ix, iy, 3) = 255;
-}
+  addText(state, "Source", hostname);
 
-int threadCount = thread::hardware_concurrency();
+  if (maybeAuthor) {
+    addText(state, "Comment",
+            title + "\nCopyright " + copyright + "\nCreated by " +
+                maybeAuthor + "@" + hostname + " using " + software +
+                ".\n" + description);
+  } else {
+    addText(state, "Comment",
+            title + "\nCopyright " + copyright + "\nCreated on " +
+                hostname + " using " + software + ".\n" + description);
+  }
 
-template <typename T>
-void threadWorker(const Params<T> &params, Image *img, int mod) {
-  for (int iy = mod; iy < params.HD_IMG_HEIGHT; iy += threadCount)
-    for (int ix = 0; ix < params.HD_IMG_WIDTH; ++ix) {
-      img->iterations(ix, iy) = iterations(params, ix, iy);
+  // The pixels are already in the output colour type, so skip lodepng's
+  // scan for the smallest colour type and its conversion pass.
+  const LodePNGColorType type = palette.empty() ? LCT_RGB : LCT_PALETTE;
+  for (LodePNGColorMode *mode : {&state->info_raw, &state->info_png.color}) {
+    mode->colortype = type;
+    mode->bitdepth = 8;
+    for (const auto &rgb : palette) {
+      unsigned err = lodepng_palette_add(mode, rgb[0], rgb[1], rgb[2], 255);
+      if (err) throw err;
     }
-  cout << "Finished thread " << mod << endl;
+  }
+  state->encoder.auto_convert = 0;
+
+  setCompression(params.compression, &state->encoder);
 }
 
-}  // namespace
+// Frame delay of animations in hundredths of a second, as the server used to
+// make GIFs
+constexpr int FRAME_DELAY = 4;
 
-int main(int argc, char *const argv[]) {
-  Params<long double> params;
+/**
+ * PNG encoder fed the image a batch of rows at a time, top to bottom. Each
+ * batch is filtered and deflated on all cores and written to the output
+ * as one IDAT chunk, the zlib stream running on from chunk to
+ * chunk, so memory is bounded by a batch plus the deflate window rather than
+ * by the whole image. Colour type, palette, text and compression settings
+ * come from state. Errors are thrown as lodepng error codes.
+ *
+ * Given a frame count it instead writes an animated PNG, looping forever,
+ * fed a whole frame at a time. Each frame after the first only encodes the
+ * rectangle that differs from the frame before, over which it replaces the
+ * previous frame.
+ */
+class PngStream {
+  OutputFile *const _out;
+  const lodepng::State &_state;
+  const unsigned _width;
+  const unsigned _height;
+  const size_t _rowBytes;
+  const bool _bounce;
+  unsigned _y = 0;
+  unsigned _adler = 1;
+  unsigned _sequence = 0;  // of the animation's fcTL and fdAT chunks
+  // The frames so far if bouncing, otherwise just the last one
+  vector<vector<unsigned char>> _frames;
+  // The last row of the previous batch (zeros before the first, which is
+  // what PNG filters assume) followed by the rows of this batch
+  vector<unsigned char> _rows;
+  // The same rows filtered, each behind its filter type byte
+  vector<unsigned char> _filtered;
+  // Deflate input: the last windowsize bytes filtered so far, for matches to
+  // refer back to, followed by the filtered rows of this batch
+  vector<unsigned char> _window;
+  vector<unsigned char> _idat;
+  ParallelDeflater _deflater;
+  // The fcTL data and the chunk being written, reused to not allocate per
+  // frame
+  vector<unsigned char> _control;
+  vector<unsigned char> _chunk;
 
-  int opt;
-  while ((opt = getopt(argc, argv, "W:H:x:y:w:i:o:")) != -1) {
-    switch (opt) {
-      case 'W':
-        params.HD_IMG_WIDTH = atoi(optarg);
-        break;
-      case 'H':
-        params.HD_IMG_HEIGHT = atoi(optarg);
-        break;
-      case 'x':
-        params.centerRe = strtold(optarg, NULL);
-        break;
-      case 'y':
-        params.centerIm = strtold(optarg, NULL);
-        break;
-      case 'w':
-        params.width = strtold(optarg, NULL);
-        break;
-      case 'i':
-        params.maxIterationCount = atoi(optarg);
-        break;
-      case 'o':
-        params.outputFileName = optarg;
-        break;
-      default: /* '?' */
-        cerr << "Usage: " << argv[0]
-             << " -W HD_IMG_WIDTH -H HD_IMG_HEIGHT -x centerReal -y "
-                "centerImaginary "
-                "-w "
-                "viewportWidth -i iterations"
-             << endl
-             << "  defaults:  -W 1400 -H 900  -x -0.5671 -y -0.56698 -w 0.2 "
-                "-i "
-                "10000 -o mandelbrot.png"
-             << endl;
-        return EXIT_FAILURE;
+  void writeChunk(const char *type, const unsigned char *data, size_t size) {
+    if (size > (1u << 31)) throw 77u;  // lodepng's chunk too large error
+    _chunk.clear();
+    appendBigEndian(&_chunk, size);
+    _chunk.insert(_chunk.end(), type, type + 4);
+    _chunk.insert(_chunk.end(), data, data + size);
+    _chunk.resize(_chunk.size() + 4);
+    lodepng_chunk_generate_crc(_chunk.data());
+    _out->write(_chunk.data(), _chunk.size());
+  }
+
+  static void appendBigEndian(vector<unsigned char> *out, unsigned value,
+                              int bytes = 4) {
+    for (int i = bytes - 1; i >= 0; --i) {
+      out->push_back(value >> (8 * i));
     }
   }
 
-  Image img(params.HD_IMG_WIDTH, params.HD_IMG_HEIGHT);
-  Stats stats;
-  vector<thread> threads;
-  for (int mod = 0; mod < threadCount; ++mod) {
-    threads.emplace_back(threadWorker<long double>, params, &img, mod);
+  /**
+   * The smallest rectangle [x0, x1) x [y0, y1) holding every pixel of frame
+   * that differs from previous, empty if none do.
+   */
+  void changedRegion(const unsigned char *frame, const unsigned char *previous,
+                     unsigned *x0, unsigned *y0, unsigned *x1,
+                     unsigned *y1) const {
+    const size_t pixelBytes = _rowBytes / _width;
+    auto row = [&](const unsigned char *pixels, unsigned y) {
+      return pixels + y * _rowBytes;
+    };
+    *y0 = 0;
+    while (*y0 < _height &&
+           memcmp(row(frame, *y0), row(previous, *y0), _rowBytes) == 0) {
+      ++*y0;
+    }
+    *y1 = _height;
+    while (*y1 > *y0 &&
+           memcmp(row(frame, *y1 - 1), row(previous, *y1 - 1), _rowBytes) ==
+               0) {
+      --*y1;
+    }
+    size_t left = _rowBytes;
+    size_t right = 0;
+    for (unsigned y = *y0; y < *y1; ++y) {
+      const unsigned char *a = row(frame, y);
+      const unsigned char *b = row(previous, y);
+      size_t i = 0;
+      while (i < left && a[i] == b[i]) ++i;
+      left = i;
+      size_t j = _rowBytes;
+      while (j > right && a[j - 1] == b[j - 1]) --j;
+      right = j;
+    }
+    *x0 = left < right ? left / pixelBytes : 0;
+    *x1 = left < right ? (right + pixelBytes - 1) / pixelBytes : 0;
   }
-  for (auto &thread : threads) {
-    thread.join();
+
+  /**
+   * Writes a frame's fcTL chunk and the pixels that differ from the previous
+   * frame in an fdAT chunk, or all of them in the IDAT if it is the first.
+   */
+  void writeFrame(const unsigned char *frame, const unsigned char *previous) {
+    unsigned x0 = 0, y0 = 0, x1 = _width, y1 = _height;
+    if (previous) {
+      changedRegion(frame, previous, &x0, &y0, &x1, &y1);
+      // A frame cannot be empty, so an unchanged one repeats a pixel
+      if (x0 == x1 || y0 == y1) x0 = y0 = 0, x1 = y1 = 1;
+    }
+    const unsigned width = x1 - x0;
+    const unsigned height = y1 - y0;
+
+    _control.clear();
+    appendBigEndian(&_control, _sequence++);
+    for (unsigned value : {width, height, x0, y0}) {
+      appendBigEndian(&_control, value);
+    }
+    appendBigEndian(&_control, FRAME_DELAY, 2);
+    appendBigEndian(&_control, 100, 2);
+    // Leave the frame in place for the next, and replace what is under it
+    _control.insert(_control.end(), {0, 0});
+    writeChunk("fcTL", _control.data(), _control.size());
+
+    // The region's rows, filtered and deflated as one zlib stream
+    const size_t pixelBytes = _rowBytes / _width;
+    const size_t rowBytes = width * pixelBytes;
+    _rows.resize(height * rowBytes);
+    for (unsigned y = 0; y < height; ++y) {
+      memcpy(&_rows[y * rowBytes],
+             frame + (y0 + y) * _rowBytes + x0 * pixelBytes, rowBytes);
+    }
+    _filtered.resize(height * (1 + rowBytes));
+    unsigned err = parallelFilter(_filtered.data(), _rows.data(), width,
+                                  height, &_state.info_png.color,
+                                  &_state.encoder);
+    if (err) throw err;
+    _idat.clear();
+    if (previous) appendBigEndian(&_idat, _sequence++);
+    _idat.insert(_idat.end(), {0x78, 0x01});
+    unsigned adler = 1;
+    err = _deflater.deflate(&_idat, &adler, _filtered.data(), 0,
+                            _filtered.size(), true,
+                            &_state.encoder.zlibsettings);
+    if (err) throw err;
+    appendBigEndian(&_idat, adler);
+    writeChunk(previous ? "fdAT" : "IDAT", _idat.data(), _idat.size());
   }
 
-  for (int iy = 0; iy < params.HD_IMG_HEIGHT; ++iy)
-    for (int ix = 0; ix < params.HD_IMG_WIDTH; ++ix) {
-      int iters = img.iterations(ix, iy);
-      if (iters != params.maxIterationCount) {
-        stats(iters);
+ public:
+  /**
+   * Writes the PNG signature and the chunks that go before the IDATs. For an
+   * animation, frames is the number of frames to be added, which are written
+   * again backwards at the end if bounce is set.
+   */
+  PngStream(OutputFile *out, const lodepng::State &state, unsigned width,
+            unsigned height, unsigned frames = 0, bool bounce = false)
+      : _out(out),
+        _state(state),
+        _width(width),
+        _height(height),
+        _rowBytes(lodepng_get_raw_size(width, 1, &state.info_png.color)),
+        _bounce(bounce),
+        _rows(_rowBytes, 0) {
+    static const unsigned char SIGNATURE[] = {137, 80, 78, 71, 13, 10, 26, 10};
+    _out->write(SIGNATURE, sizeof SIGNATURE);
+
+    const LodePNGColorMode &color = state.info_png.color;
+    vector<unsigned char> header;
+    appendBigEndian(&header, width);
+    appendBigEndian(&header, height);
+    // bit depth, colour type, compression, filter and interlace methods
+    header.insert(header.end(), {(unsigned char)color.bitdepth,
+                                 (unsigned char)color.colortype, 0, 0, 0});
+    writeChunk("IHDR", header.data(), header.size());
+
+    if (color.colortype == LCT_PALETTE) {
+      vector<unsigned char> palette;
+      for (size_t i = 0; i < color.palettesize; ++i) {
+        palette.insert(palette.end(), color.palette + 4 * i,
+                       color.palette + 4 * i + 3);
       }
+      writeChunk("PLTE", palette.data(), palette.size());
     }
-  stats(params.maxIterationCount);
-  stats.preparePercentile();
-  for (int iy = 0; iy < params.HD_IMG_HEIGHT; ++iy)
-    for (int ix = 0; ix < params.HD_IMG_WIDTH; ++ix) {
-      double shade = ix > 0 && iy > 0 && ix < params.HD_IMG_WIDTH - 1 &&
-                             iy < params.HD_IMG_HEIGHT - 1
-                         ? img.hillshade(ix, iy)
-                         : 0;
-      setColor(stats, &img, params.maxIterationCount, ix, iy, shade);
+
+    if (frames > 0) {
+      vector<unsigned char> animation;
+      appendBigEndian(&animation, bounce ? 2 * frames : frames);
+      appendBigEndian(&animation, 0);  // loop forever
+      writeChunk("acTL", animation.data(), animation.size());
     }
+  }
 
-  bool ok = img.writePng(params);
+  /** Encodes and writes the next frame of an animation. */
+  void addFrame(const unsigned char *frame) {
+    writeFrame(frame, _frames.empty() ? nullptr : _frames.back().data());
+    if (_bounce || _frames.empty()) _frames.emplace_back();
+    _frames.back().assign(frame, frame + _height * _rowBytes);
+  }
 
-  ofstream histogram("histogram.csv");
-  histogram << stats;
-  histogram.close();
+  /** Encodes and writes the next n rows of raw pixels. */
+  void addRows(const unsigned char *rows, unsigned n) {
+    assert(_y + n <= _height);
+    _rows.resize((1 + n) * _rowBytes);
+    memcpy(&_rows[_rowBytes], rows, n * _rowBytes);
+    _filtered.resize((1 + n) * (1 + _rowBytes));
+    unsigned err = parallelFilter(_filtered.data(), _rows.data(), _width, 1 + n,
+                                  &_state.info_png.color, &_state.encoder);
+    if (err) throw err;
+    memcpy(_rows.data(), &_rows[n * _rowBytes], _rowBytes);
+
+    const size_t dictionary = std::min<size_t>(
+        _window.size(), _state.encoder.zlibsettings.windowsize);
+    _window.erase(_window.begin(), _window.end() - dictionary);
+    _window.insert(_window.end(), _filtered.begin() + 1 + _rowBytes,
+                   _filtered.end());
+
+    _idat.clear();
+    if (_y == 0) {
+      // CM 8 with a 32K window, no dictionary, FCHECK making it a multiple of
+      // 31
+      _idat.insert(_idat.end(), {0x78, 0x01});
+    }
+    _y += n;
+    err = _deflater.deflate(&_idat, &_adler, _window.data(), dictionary,
+                            _window.size(), _y == _height,
+                            &_state.encoder.zlibsettings);
+    if (err) throw err;
+    if (_y == _height) appendBigEndian(&_idat, _adler);
+    writeChunk("IDAT", _idat.data(), _idat.size());
+  }
+
+  /**
+   * Writes the frames again backwards if bouncing, then the text chunks and
+   * IEND, once all rows or frames have been added.
+   */
+  void finish() {
+    assert(_y == _height || _sequence > 0);
+    if (_bounce) {
+      // Starting with the last frame again, unchanged
+      for (size_t i = _frames.size(); i-- > 0;) {
+        const size_t next = std::min(i + 1, _frames.size() - 1);
+        writeFrame(_frames[i].data(), _frames[next].data());
+      }
+    }
+    const LodePNGInfo &info = _state.info_png;
+    for (size_t i = 0; i < info.text_num; ++i) {
+      const char *key = info.text_keys[i];
+      const char *text = info.text_strings[i];
+      vector<unsigned char> data(key, key + strlen(key) + 1);
+      if (_state.encoder.text_compression) {
+        unsigned char *compressed = nullptr;
+        size_t compressedSize = 0;
+        const unsigned err = lodepng_zlib_compress(
+            &compressed, &compressedSize, (const unsigned char *)text,
+            strlen(text), &_state.encoder.zlibsettings);
+        unique_ptr<unsigned char, void (*)(void *)> owner(compressed, free);
+        if (err) throw err;
+        data.push_back(0);  // compression method
+        data.insert(data.end(), compressed, compressed + compressedSize);
+        writeChunk("zTXt", data.data(), data.size());
+      } else {
+        data.insert(data.end(), text, text + strlen(text));
+        writeChunk("tEXt", data.data(), data.size());
+      }
+    }
+    writeChunk("IEND", nullptr, 0);
+  }
+};
+
+// Size of the hill-shading kernel's cells, in pixels
+constexpr double KERNELSIZE = 1;
+
+/**
+ * Coefficients of the trig-free hillshade formula of Image::shadeRow for a
+ * light source at altitude and azimuth degrees over a surface exaggerated by
+ * zFactor, applied directly to the unscaled integer Sobel sums
+ * gx = 8 * KERNELSIZE * dz/dx (likewise gy).
+ */
+struct Shading {
+  double cosZenith;
+  double gx;
+  double gy;
+  double g2;
+
+  Shading(double altitude, double azimuth, double zFactor) {
+    const double zenith = M_PI / 2 - altitude * M_PI / 180;
+    azimuth = azimuth * M_PI / 180;
+    cosZenith = cos(zenith);
+    gx = -sin(zenith) * zFactor * cos(azimuth) / (8 * KERNELSIZE);
+    gy = sin(zenith) * zFactor * sin(azimuth) / (8 * KERNELSIZE);
+    g2 = zFactor * zFactor / (64 * KERNELSIZE * KERNELSIZE);
+  }
+};
+
+// The image is processed in square tiles, small enough that the working set
+// of colouring one (its iteration counts plus the one-pixel halo read by
+// hillshade, its shades and its pixels) fits in cache. All the tiles are
+// computed before any is coloured, so the counts come back from memory.
+constexpr int TILE_BITS = 6;
+constexpr int TILE_SIZE = 1 << TILE_BITS;
+constexpr int TILE_MASK = TILE_SIZE - 1;
+
+/**
+ * How Image lays out its per-pixel buffers in memory. TILES is only an
+ * option: it has not measured faster than ROWS, and the encoders need the
+ * pixels de-tiled into rows, so ROWS is the default.
+ */
+enum class Layout {
+  ROWS,   // row-major, ix changing fastest
+  TILES,  // row-major TILE_SIZE x TILE_SIZE tiles, themselves in row order
+};
+
+/**
+ * QOI ("Quite OK Image", https://qoiformat.org) encoder fed the RGB pixels
+ * of the image in row-major order a batch at a time, writing each batch out
+ * as it is encoded. QOI is lossless and encodes in one pass over the pixels
+ * with no entropy coding, much faster than PNG though less compact, which
+ * suits frames that are decoded again straight away.
+ */
+class QoiStream {
+  static constexpr unsigned char OP_INDEX = 0x00;
+  static constexpr unsigned char OP_DIFF = 0x40;
+  static constexpr unsigned char OP_LUMA = 0x80;
+  static constexpr unsigned char OP_RUN = 0xc0;
+  static constexpr unsigned char OP_RGB = 0xfe;
+  static constexpr int MAX_RUN = 62;
+  // Not a 0xRRGGBB value, so empty index entries never match a pixel
+  static constexpr unsigned EMPTY = ~0u;
+
+  OutputFile *const _out;
+  size_t _remaining;  // pixels still to come
+  // Pixels seen, as 0xRRGGBB, at their hash (alpha is always 255)
+  unsigned _index[64];
+  unsigned _previous = 0x000000;
+  int _run = 0;
+  vector<unsigned char> _buffer;
+
+  static void appendBigEndian(vector<unsigned char> *out, unsigned value) {
+    for (int i = 0; i < 4; ++i) {
+      out->push_back(value >> (24 - 8 * i));
+    }
+  }
+
+ public:
+  /** Writes the QOI header. */
+  QoiStream(OutputFile *out, unsigned width, unsigned height)
+      : _out(out), _remaining(size_t(width) * height) {
+    std::fill(_index, _index + 64, EMPTY);
+    _buffer.insert(_buffer.end(), {'q', 'o', 'i', 'f'});
+    appendBigEndian(&_buffer, width);
+    appendBigEndian(&_buffer, height);
+    _buffer.insert(_buffer.end(), {3, 0});  // RGB, sRGB with linear alpha
+    _out->write(_buffer.data(), _buffer.size());
+  }
+
+  /** Encodes and writes the next n pixels, as packed RGB. */
+  void addPixels(const unsigned char *rgb, size_t n) {
+    assert(n <= _remaining);
+    _buffer.clear();
+    _buffer.reserve(4 * n);
+    for (const unsigned char *end = rgb + 3 * n; rgb != end; rgb += 3) {
+      const unsigned pixel = rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+      --_remaining;
+      if (pixel == _previous) {
+        if (++_run == MAX_RUN || _remaining == 0) {
+          _buffer.push_back(OP_RUN | (_run - 1));
+          _run = 0;
+        }
+        continue;
+      }
+      if (_run > 0) {
+        _buffer.push_back(OP_RUN | (_run - 1));
+        _run = 0;
+      }
+      const int hash = (rgb[0] * 3 + rgb[1] * 5 + rgb[2] * 7 + 255 * 11) % 64;
+      if (_index[hash] == pixel) {
+        _buffer.push_back(OP_INDEX | hash);
+      } else {
+        _index[hash] = pixel;
+        // Channel differences wrap around, as in the reference encoder
+        const int dr = (signed char)(rgb[0] - (_previous >> 16));
+        const int dg = (signed char)(rgb[1] - (_previous >> 8 & 0xff));
+        const int db = (signed char)(rgb[2] - (_previous & 0xff));
+        const int drDg = dr - dg;
+        const int dbDg = db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+            db <= 1) {
+          _buffer.push_back(OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 |
+                            (db + 2));
+        } else if (dg >= -32 && dg <= 31 && drDg >= -8 && drDg <= 7 &&
+                   dbDg >= -8 && dbDg <= 7) {
+          _buffer.push_back(OP_LUMA | (dg + 32));
+          _buffer.push_back((drDg + 8) << 4 | (dbDg + 8));
+        } else {
+          _buffer.insert(_buffer.end(), {OP_RGB, rgb[0], rgb[1], rgb[2]});
+        }
+      }
+      _previous = pixel;
+    }
+    _out->write(_buffer.data(), _buffer.size());
+  }
+
+  /** Writes the end marker once all pixels have been added. */
+  void finish() {
+    assert(_remaining == 0);
+    static const unsigned char END[] = {0, 0, 0, 0, 0, 0, 0, 1};
+    _out->write(END, sizeof END);
+  }
+};
+
+// Quality of JPEG output on the IJG scale, enough for previews that are many
+// times smaller than the PNG
+constexpr int JPEG_QUALITY = 85;
+
+/**
+ * Baseline JPEG encoder fed the RGB pixels of the image a batch of rows at a
+ * time, writing each batch out as it is encoded. It uses JFIF's full-range
+ * YCbCr with 4:2:0 chroma subsampling and the example quantization and
+ * Huffman tables of the standard's Annex K, quantization scaled to quality as
+ * the IJG library does. Each row of MCUs is a restart interval, so the DC
+ * predictions start again at every row and the rows are entropy coded on all
+ * cores independently, with output that does not depend on the batches.
+ */
+class JpegStream {
+ public:
+  // Pixels across and down an MCU: four luma blocks and one of each chroma
+  static constexpr int MCU_SIZE = 16;
+
+ private:
+  // Natural-order index of each coefficient in zigzag order
+  static constexpr unsigned char ZIGZAG[64] = {
+      0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+      12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+      35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+      58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+  // Quantization tables for quality 50, in natural order
+  static constexpr unsigned char LUMA_QUANT[64] = {
+      16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+      14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+      18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+      49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+  static constexpr unsigned char CHROMA_QUANT[64] = {
+      17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+      24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+      99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+      99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+  // Huffman tables, each the number of codes of lengths 1 to 16 followed by
+  // the symbols in order of their codes
+  static constexpr unsigned char DC_LUMA[16 + 12] = {
+      0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+      0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+  static constexpr unsigned char DC_CHROMA[16 + 12] = {
+      0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+      0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+  static constexpr unsigned char AC_LUMA[16 + 162] = {
+      0,    2,    1,    3,    3,    2,    4,    3,    5,    5,    4,    4,
+      0,    0,    1,    0x7d, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+      0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32,
+      0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+      0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a,
+      0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+      0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55,
+      0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+      0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85,
+      0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+      0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2,
+      0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+      0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8,
+      0xd9, 0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+      0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+  static constexpr unsigned char AC_CHROMA[16 + 162] = {
+      0,    2,    1,    2,    4,    4,    3,    4,    7,    5,    4,    4,
+      0,    1,    2,    0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+      0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81,
+      0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+      0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17,
+      0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+      0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54,
+      0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+      0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83,
+      0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+      0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9,
+      0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+      0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6,
+      0xd7, 0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+      0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+  /** The code and its length for each symbol of a Huffman table. */
+  struct HuffmanCodes {
+    unsigned short code[256];
+    unsigned char length[256];
+
+    explicit HuffmanCodes(const unsigned char *table) {
+      const unsigned char *symbol = table + 16;
+      unsigned next = 0;
+      for (int bits = 1; bits <= 16; ++bits, next <<= 1) {
+        for (int i = 0; i < table[bits - 1]; ++i, ++next, ++symbol) {
+          code[*symbol] = next;
+          length[*symbol] = bits;
+        }
+      }
+    }
+  };
+
+  /** Entropy-coded data packed most significant bit first, 0xFF stuffed. */
+  class EntropyWriter {
+    unsigned _bits = 0;
+    int _count = 0;  // bits in _bits not yet written
+
+   public:
+    vector<unsigned char> bytes;
+
+    void clear() {
+      bytes.clear();
+      _count = 0;
+    }
+
+    /** Appends the low length bits of value, length being at most 16. */
+    void put(unsigned value, int length) {
+      _bits = _bits << length | (value & ((1u << length) - 1));
+      _count += length;
+      while (_count >= 8) {
+        _count -= 8;
+        const unsigned char byte = _bits >> _count;
+        bytes.push_back(byte);
+        if (byte == 0xff) bytes.push_back(0);
+      }
+    }
+
+    /** Pads the last byte with one bits. */
+    void flush() {
+      if (_count > 0) put(0xff, 8 - _count);
+    }
+  };
+
+  /**
+   * DCT-II matrix of the 8-point transform, orthonormal so that the 2D
+   * transform M B M^T gives the coefficients JPEG defines, and its transpose.
+   */
+  struct DctMatrix {
+    alignas(16) float forward[64];
+    alignas(16) float transposed[64];
+
+    DctMatrix() {
+      for (int u = 0; u < 8; ++u) {
+        for (int x = 0; x < 8; ++x) {
+          const double scale = u == 0 ? sqrt(0.125) : 0.5;
+          forward[8 * u + x] = transposed[8 * x + u] =
+              scale * cos((2 * x + 1) * u * M_PI / 16);
+        }
+      }
+    }
+  };
+
+  OutputFile *const _out;
+  const int _width;
+  const int _height;
+  int _y = 0;  // next row of the image
+  // Quantization tables in zigzag order as written, and as the reciprocals
+  // the coefficients are multiplied by, in natural order
+  unsigned char _lumaQuant[64];
+  unsigned char _chromaQuant[64];
+  alignas(16) float _lumaScale[64];
+  alignas(16) float _chromaScale[64];
+  const HuffmanCodes _dcLuma{DC_LUMA};
+  const HuffmanCodes _acLuma{AC_LUMA};
+  const HuffmanCodes _dcChroma{DC_CHROMA};
+  const HuffmanCodes _acChroma{AC_CHROMA};
+  // Entropy-coded data of each row of MCUs in the batch
+  vector<EntropyWriter> _segments;
+  vector<unsigned char> _buffer;
+
+  static void appendBigEndian(vector<unsigned char> *out, unsigned value) {
+    out->push_back(value >> 8);
+    out->push_back(value);
+  }
+
+  /** Appends a marker segment with its length. */
+  static void appendSegment(vector<unsigned char> *out, unsigned char marker,
+                            const vector<unsigned char> &data) {
+    out->insert(out->end(), {0xff, marker});
+    appendBigEndian(out, 2 + data.size());
+    out->insert(out->end(), data.begin(), data.end());
+  }
+
+  /** Scales a quality 50 table as the IJG library does, in zigzag order. */
+  static void scaleQuant(const unsigned char *base, int quality,
+                         unsigned char *quant, float *scale) {
+    const int percent = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+    for (int k = 0; k < 64; ++k) {
+      const int q = std::min(std::max((base[k] * percent + 50) / 100, 1), 255);
+      quant[std::find(ZIGZAG, ZIGZAG + 64, k) - ZIGZAG] = q;
+      scale[k] = 1.0f / q;
+    }
+  }
+
+  /**
+   * JFIF luma of n pixels from planes of r, g and b, less 128 to centre it on
+   * zero for the DCT.
+   */
+  static void luma(const float *r, const float *g, const float *b, int n,
+                   float *y) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 kr = _mm_set1_ps(0.299f);
+    const __m128 kg = _mm_set1_ps(0.587f);
+    const __m128 kb = _mm_set1_ps(0.114f);
+    const __m128 offset = _mm_set1_ps(128);
+    for (; i + 4 <= n; i += 4) {
+      const __m128 sum = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(kr, _mm_load_ps(r + i)),
+                     _mm_mul_ps(kg, _mm_load_ps(g + i))),
+          _mm_mul_ps(kb, _mm_load_ps(b + i)));
+      _mm_store_ps(y + i, _mm_sub_ps(sum, offset));
+    }
+#endif
+    for (; i < n; ++i) {
+      y[i] = 0.299f * r[i] + 0.587f * g[i] + 0.114f * b[i] - 128;
+    }
+  }
+
+  /**
+   * JFIF chroma, which is centred on zero already, of n pixels from planes of
+   * r, g and b that are each the sum of four pixels.
+   */
+  static void chroma(const float *r, const float *g, const float *b, int n,
+                     float *cb, float *cr) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 bR = _mm_set1_ps(-0.168736f / 4);
+    const __m128 bG = _mm_set1_ps(-0.331264f / 4);
+    const __m128 half = _mm_set1_ps(0.5f / 4);
+    const __m128 rG = _mm_set1_ps(-0.418688f / 4);
+    const __m128 rB = _mm_set1_ps(-0.081312f / 4);
+    for (; i + 4 <= n; i += 4) {
+      const __m128 vr = _mm_load_ps(r + i);
+      const __m128 vg = _mm_load_ps(g + i);
+      const __m128 vb = _mm_load_ps(b + i);
+      _mm_store_ps(cb + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(bR, vr),
+                                                 _mm_mul_ps(bG, vg)),
+                                      _mm_mul_ps(half, vb)));
+      _mm_store_ps(cr + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(half, vr),
+                                                 _mm_mul_ps(rG, vg)),
+                                      _mm_mul_ps(rB, vb)));
+    }
+#endif
+    for (; i < n; ++i) {
+      cb[i] = (-0.168736f * r[i] - 0.331264f * g[i] + 0.5f * b[i]) / 4;
+      cr[i] = (0.5f * r[i] - 0.418688f * g[i] - 0.081312f * b[i]) / 4;
+    }
+  }
+
+  /**
+   * Transforms the 8x8 block at in, with rows stride apart, and quantizes it
+   * with scale into coefficients in zigzag order.
+   */
+  static void transform(const float *in, int stride, const float *scale,
+                        int *zigzag) {
+    static const DctMatrix M;
+    alignas(16) float rows[64];  // B M^T
+    alignas(16) int quantized[64];
+#ifdef __SSE2__
+    for (int y = 0; y < 8; ++y) {
+      __m128 lo = _mm_setzero_ps();
+      __m128 hi = _mm_setzero_ps();
+      for (int x = 0; x < 8; ++x) {
+        const __m128 v = _mm_set1_ps(in[y * stride + x]);
+        lo = _mm_add_ps(lo, _mm_mul_ps(v, _mm_load_ps(M.transposed + 8 * x)));
+        hi = _mm_add_ps(hi,
+                        _mm_mul_ps(v, _mm_load_ps(M.transposed + 8 * x + 4)));
+      }
+      _mm_store_ps(rows + 8 * y, lo);
+      _mm_store_ps(rows + 8 * y + 4, hi);
+    }
+    for (int u = 0; u < 8; ++u) {
+      __m128 lo = _mm_setzero_ps();
+      __m128 hi = _mm_setzero_ps();
+      for (int y = 0; y < 8; ++y) {
+        const __m128 m = _mm_set1_ps(M.forward[8 * u + y]);
+        lo = _mm_add_ps(lo, _mm_mul_ps(m, _mm_load_ps(rows + 8 * y)));
+        hi = _mm_add_ps(hi, _mm_mul_ps(m, _mm_load_ps(rows + 8 * y + 4)));
+      }
+      // Rounded to nearest, the default rounding mode
+      _mm_store_si128(
+          reinterpret_cast<__m128i *>(quantized + 8 * u),
+          _mm_cvtps_epi32(_mm_mul_ps(lo, _mm_load_ps(scale + 8 * u))));
+      _mm_store_si128(
+          reinterpret_cast<__m128i *>(quantized + 8 * u + 4),
+          _mm_cvtps_epi32(_mm_mul_ps(hi, _mm_load_ps(scale + 8 * u + 4))));
+    }
+#else
+    for (int y = 0; y < 8; ++y) {
+      for (int v = 0; v < 8; ++v) {
+        float sum = 0;
+        for (int x = 0; x < 8; ++x) {
+          sum += in[y * stride + x] * M.transposed[8 * x + v];
+        }
+        rows[8 * y + v] = sum;
+      }
+    }
+    for (int u = 0; u < 8; ++u) {
+      for (int v = 0; v < 8; ++v) {
+        float sum = 0;
+        for (int y = 0; y < 8; ++y) {
+          sum += M.forward[8 * u + y] * rows[8 * y + v];
+        }
+        quantized[8 * u + v] = lrintf(sum * scale[8 * u + v]);
+      }
+    }
+#endif
+    for (int k = 0; k < 64; ++k) {
+      zigzag[k] = quantized[ZIGZAG[k]];
+    }
+  }
+
+  /** Appends a coefficient's size category and then its bits. */
+  static void putValue(int value, int symbol, const HuffmanCodes &codes,
+                       EntropyWriter *out) {
+    int size = 0;
+    for (int magnitude = abs(value); magnitude > 0; magnitude >>= 1) ++size;
+    symbol |= size;
+    out->put(codes.code[symbol], codes.length[symbol]);
+    // Negative values are written as value - 1 in size bits
+    if (size > 0) out->put(value < 0 ? value - 1 : value, size);
+  }
+
+  /** Transforms and entropy codes a block, updating the DC prediction. */
+  static void encodeBlock(const float *in, int stride, const float *scale,
+                          const HuffmanCodes &dc, const HuffmanCodes &ac,
+                          int *prediction, EntropyWriter *out) {
+    int zigzag[64];
+    transform(in, stride, scale, zigzag);
+    putValue(zigzag[0] - *prediction, 0, dc, out);
+    *prediction = zigzag[0];
+    int run = 0;
+    for (int k = 1; k < 64; ++k) {
+      if (zigzag[k] == 0) {
+        ++run;
+        continue;
+      }
+      for (; run >= 16; run -= 16) {
+        out->put(ac.code[0xf0], ac.length[0xf0]);  // 16 zeros
+      }
+      putValue(zigzag[k], run << 4, ac, out);
+      run = 0;
+    }
+    if (run > 0) out->put(ac.code[0], ac.length[0]);  // end of block
+  }
+
+  /**
+   * Encodes a row of MCUs from the n rows of RGB pixels at rgb, repeating the
+   * last row and column to fill the MCUs on the bottom and right edges.
+   */
+  void encodeRow(const unsigned char *rgb, int n, EntropyWriter *out) const {
+    constexpr int AREA = MCU_SIZE * MCU_SIZE;
+    constexpr int HALF = MCU_SIZE / 2;
+    alignas(16) float r[AREA], g[AREA], b[AREA], y[AREA];
+    // Sums of the 2x2 pixels of each chroma sample
+    alignas(16) float r4[AREA / 4], g4[AREA / 4], b4[AREA / 4];
+    alignas(16) float cb[AREA / 4], cr[AREA / 4];
+    int predictions[3] = {0, 0, 0};
+    for (int x0 = 0; x0 < _width; x0 += MCU_SIZE) {
+      std::fill(r4, r4 + AREA / 4, 0.0f);
+      std::fill(g4, g4 + AREA / 4, 0.0f);
+      std::fill(b4, b4 + AREA / 4, 0.0f);
+      for (int py = 0; py < MCU_SIZE; ++py) {
+        const unsigned char *row =
+            rgb + size_t(std::min(py, n - 1)) * _width * 3;
+        for (int px = 0; px < MCU_SIZE; ++px) {
+          const unsigned char *pixel =
+              row + 3 * std::min(x0 + px, _width - 1);
+          const int i = py * MCU_SIZE + px;
+          const int j = py / 2 * HALF + px / 2;
+          r4[j] += r[i] = pixel[0];
+          g4[j] += g[i] = pixel[1];
+          b4[j] += b[i] = pixel[2];
+        }
+      }
+      luma(r, g, b, AREA, y);
+      chroma(r4, g4, b4, AREA / 4, cb, cr);
+      for (int block = 0; block < 4; ++block) {
+        const float *in = y + (block >> 1) * 8 * MCU_SIZE + (block & 1) * 8;
+        encodeBlock(in, MCU_SIZE, _lumaScale, _dcLuma, _acLuma,
+                    &predictions[0], out);
+      }
+      encodeBlock(cb, HALF, _chromaScale, _dcChroma, _acChroma,
+                  &predictions[1], out);
+      encodeBlock(cr, HALF, _chromaScale, _dcChroma, _acChroma,
+                  &predictions[2], out);
+    }
+  }
+
+ public:
+  /** Writes the JPEG headers, the image being at most 65535 each way. */
+  JpegStream(OutputFile *out, int width, int height, int quality)
+      : _out(out), _width(width), _height(height) {
+    assert(width <= 65535 && height <= 65535);
+    scaleQuant(LUMA_QUANT, quality, _lumaQuant, _lumaScale);
+    scaleQuant(CHROMA_QUANT, quality, _chromaQuant, _chromaScale);
+
+    _buffer.insert(_buffer.end(), {0xff, 0xd8});  // start of image
+    // JFIF 1.01, square pixels and no thumbnail
+    appendSegment(&_buffer, 0xe0,
+                  {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0});
+
+    vector<unsigned char> data = {0};
+    data.insert(data.end(), _lumaQuant, _lumaQuant + 64);
+    data.push_back(1);
+    data.insert(data.end(), _chromaQuant, _chromaQuant + 64);
+    appendSegment(&_buffer, 0xdb, data);
+
+    // Baseline frame of 8-bit samples, luma at twice the chroma resolution
+    // both ways
+    data = {8};
+    appendBigEndian(&data, height);
+    appendBigEndian(&data, width);
+    data.insert(data.end(), {3, 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1});
+    appendSegment(&_buffer, 0xc0, data);
+
+    data.clear();
+    const struct {
+      unsigned char id;
+      const unsigned char *table;
+      int symbols;
+    } TABLES[] = {{0x00, DC_LUMA, 12},
+                  {0x10, AC_LUMA, 162},
+                  {0x01, DC_CHROMA, 12},
+                  {0x11, AC_CHROMA, 162}};
+    for (const auto &table : TABLES) {
+      data.push_back(table.id);
+      data.insert(data.end(), table.table, table.table + 16 + table.symbols);
+    }
+    appendSegment(&_buffer, 0xc4, data);
+
+    // A restart interval of one row of MCUs
+    data.clear();
+    appendBigEndian(&data, (width + MCU_SIZE - 1) / MCU_SIZE);
+    appendSegment(&_buffer, 0xdd, data);
+
+    // All three components in one scan, luma with the first tables and
+    // chroma with the second, over all 64 coefficients
+    appendSegment(&_buffer, 0xda,
+                  {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0});
+    _out->write(_buffer.data(), _buffer.size());
+  }
+
+  /**
+   * Encodes and writes the next n rows of packed RGB pixels, n being a
+   * multiple of MCU_SIZE unless they are the last rows of the image.
+   */
+  void addRows(const unsigned char *rgb, int n) {
+    assert(_y + n <= _height && (n % MCU_SIZE == 0 || _y + n == _height));
+    const size_t rows = (n + MCU_SIZE - 1) / MCU_SIZE;
+    if (_segments.size() < rows) _segments.resize(rows);
+    parallelFor(rows, [&](size_t i) {
+      const int y = i * MCU_SIZE;
+      EntropyWriter &segment = _segments[i];
+      segment.clear();
+      encodeRow(rgb + size_t(y) * _width * 3, std::min(MCU_SIZE, n - y),
+                &segment);
+      segment.flush();
+      // Every interval but the last ends in the next of the eight restart
+      // markers
+      const int row = (_y + y) / MCU_SIZE;
+      if (_y + y + MCU_SIZE < _height) {
+        segment.bytes.insert(segment.bytes.end(),
+                             {0xff, (unsigned char)(0xd0 + row % 8)});
+      }
+    });
+    for (size_t i = 0; i < rows; ++i) {
+      _out->write(_segments[i].bytes.data(), _segments[i].bytes.size());
+    }
+    _y += n;
+  }
+
+  /** Writes the end of image marker once all rows have been added. */
+  void finish() {
+    assert(_y == _height);
+    static const unsigned char END[] = {0xff, 0xd9};
+    _out->write(END, sizeof END);
+  }
+};
+
+// Frames per second declared in YUV4MPEG2 headers, as the server's videos
+constexpr int VIDEO_FRAME_RATE = 30;
+
+/**
+ * Uncompressed video for piping straight into ffmpeg, fed frames of RGB
+ * pixels a batch of rows at a time. It is either YUV4MPEG2 in 4:2:0, for
+ * "ffmpeg -f yuv4mpegpipe -i -", converted here with BT.601 limited-range
+ * coefficients and each chroma sample the average of a 2x2 block of pixels;
+ * or bare RGB frames, for "ffmpeg -f rawvideo -pix_fmt rgb24 -video_size WxH
+ * -i -".
+ */
+class VideoStream {
+  OutputFile *const _out;
+  const int _width;
+  const int _height;
+  const bool _yuv;
+  int _y = 0;  // next row of the frame
+  vector<unsigned char> _luma;
+  // Chroma planes of the whole frame, written after its luma plane
+  vector<unsigned char> _cb;
+  vector<unsigned char> _cr;
+
+  static unsigned char luma(int r, int g, int b) {
+    return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+  }
+
+  /** Chroma of the sums of four pixels' r, g and b. */
+  static void chroma(int r, int g, int b, unsigned char *cb,
+                     unsigned char *cr) {
+    *cb = ((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128;
+    *cr = ((112 * r - 94 * g - 18 * b + 512) >> 10) + 128;
+  }
+
+ public:
+  /** Writes the stream header, if the format has one. */
+  VideoStream(OutputFile *out, int width, int height, bool yuv)
+      : _out(out),
+        _width(width),
+        _height(height),
+        _yuv(yuv),
+        _cb(size_t((width + 1) / 2) * ((height + 1) / 2)),
+        _cr(_cb.size()) {
+    if (!_yuv) return;
+    stringstream header;
+    header << "YUV4MPEG2 W" << width << " H" << height << " F"
+           << VIDEO_FRAME_RATE << ":1 Ip A1:1 C420jpeg\n";
+    const string text = header.str();
+    _out->write((const unsigned char *)text.data(), text.size());
+  }
+
+  /**
+   * Converts and writes the next n rows of the current frame, n being even
+   * unless they are the last rows of the frame.
+   */
+  void addRows(const unsigned char *rgb, int n) {
+    assert(_y + n <= _height);
+    const size_t rowBytes = size_t(_width) * 3;
+    if (_y == 0 && _yuv) {
+      static const unsigned char FRAME[] = {'F', 'R', 'A', 'M', 'E', '\n'};
+      _out->write(FRAME, sizeof FRAME);
+    }
+    if (!_yuv) {
+      _out->write(rgb, n * rowBytes);
+      _y += n;
+      return;
+    }
+
+    _luma.resize(size_t(_width) * n);
+    for (size_t i = 0; i < _luma.size(); ++i) {
+      _luma[i] = luma(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+    }
+    _out->write(_luma.data(), _luma.size());
+
+    // An odd last row or column is paired with itself
+    const int chromaWidth = (_width + 1) / 2;
+    for (int row = 0; row < n; row += 2) {
+      const unsigned char *top = rgb + row * rowBytes;
+      const unsigned char *bottom = row + 1 < n ? top + rowBytes : top;
+      const size_t offset = size_t((_y + row) / 2) * chromaWidth;
+      for (int cx = 0; cx < chromaWidth; ++cx) {
+        const int left = 6 * cx;
+        const int right = 2 * cx + 1 < _width ? left + 3 : left;
+        int sums[3];
+        for (int c = 0; c < 3; ++c) {
+          sums[c] = top[left + c] + top[right + c] + bottom[left + c] +
+                    bottom[right + c];
+        }
+        chroma(sums[0], sums[1], sums[2], &_cb[offset + cx],
+               &_cr[offset + cx]);
+      }
+    }
+    _y += n;
+    if (_y == _height) {
+      _out->write(_cb.data(), _cb.size());
+      _out->write(_cr.data(), _cr.size());
+    }
+  }
+
+  /** Readies the stream for the next frame once all rows have been added. */
+  void endFrame() {
+    assert(_y == _height);
+    _y = 0;
+  }
+};
+
+/** Packs values into bytes least significant bit first, as GIF does. */
+class BitWriter {
+  vector<unsigned char> _bytes;
+  unsigned long long _pending = 0;
+  int _pendingBits = 0;
+
+ public:
+  /** Appends the low count bits of value, count being at most 32. */
+  void write(unsigned value, int count) {
+    _pending |= (unsigned long long)value << _pendingBits;
+    _pendingBits += count;
+    while (_pendingBits >= 8) {
+      _bytes.push_back(_pending);
+      _pending >>= 8;
+      _pendingBits -= 8;
+    }
+  }
+
+  /** Appends all the bits written to other. */
+  void append(const BitWriter &other) {
+    if (_pendingBits == 0) {
+      _bytes.insert(_bytes.end(), other._bytes.begin(), other._bytes.end());
+    } else {
+      for (unsigned char byte : other._bytes) {
+        write(byte, 8);
+      }
+    }
+    write(other._pending, other._pendingBits);
+  }
+
+  /** The bytes written, the last padded with zero bits. */
+  const vector<unsigned char> &flush() {
+    if (_pendingBits > 0) write(0, 8 - _pendingBits);
+    return _bytes;
+  }
+};
+
+/**
+ * GIF's variable-width LZW compression of n 8-bit palette indices, appended
+ * to out. The dictionary starts empty as after a clear code, which is written
+ * first if first is set. The output ends in the end code if last is set, and
+ * otherwise in a clear code, so that separately compressed parts of a frame
+ * can be concatenated like the parts of a deflate stream.
+ */
+void lzwCompress(const unsigned char *pixels, size_t n, bool first, bool last,
+                 BitWriter *out) {
+  constexpr int CLEAR = 256;
+  constexpr int END = CLEAR + 1;
+  constexpr int MAX_CODE = 4095;
+  constexpr int MIN_CODE_SIZE = 9;
+  // Open-addressed map from (prefix code, next index) to code, at most half
+  // full
+  constexpr int HASH_SIZE = 8192;
+  vector<int> keys(HASH_SIZE, -1);
+  vector<short> codes(HASH_SIZE);
+
+  int codeSize = MIN_CODE_SIZE;
+  int maxCode = END;
+  if (first) out->write(CLEAR, codeSize);
+  int current = pixels[0];
+  for (size_t i = 1; i < n; ++i) {
+    const int key = current << 8 | pixels[i];
+    unsigned slot = (key * 2654435761u) >> 19;
+    while (keys[slot] != -1 && keys[slot] != key) {
+      slot = (slot + 1) & (HASH_SIZE - 1);
+    }
+    if (keys[slot] == key) {
+      current = codes[slot];
+      continue;
+    }
+    out->write(current, codeSize);
+    keys[slot] = key;
+    codes[slot] = ++maxCode;
+    if (maxCode >= (1 << codeSize)) ++codeSize;
+    if (maxCode == MAX_CODE) {
+      out->write(CLEAR, codeSize);
+      std::fill(keys.begin(), keys.end(), -1);
+      codeSize = MIN_CODE_SIZE;
+      maxCode = END;
+    }
+    current = pixels[i];
+  }
+  out->write(current, codeSize);
+  // A decoder counts an entry for that last code too, which can widen the
+  // code after it
+  if (++maxCode >= (1 << codeSize) && codeSize < 12) ++codeSize;
+  out->write(last ? END : CLEAR, codeSize);
+}
+
+// Size of the pieces GIF frames are cut into for parallel LZW compression
+constexpr size_t LZW_PART_SIZE = 1 << 18;
+
+/**
+ * Animated GIF writer, looping forever, with one global colour table for all
+ * frames: the palette of the colour model, which is the same for every frame
+ * as it is indexed by percentile rather than by iteration count. Each frame
+ * is fed a batch of rows at a time, as palette indices, and is LZW-compressed
+ * in parts on all cores. If bounce is set, finish() repeats the frames in
+ * reverse order, for a zoom in and back out.
+ */
+class GifStream {
+  OutputFile *const _out;
+  const int _width;
+  const int _height;
+  const bool _bounce;
+  int _y = 0;  // next row of the frame
+  BitWriter _frame;
+  vector<vector<unsigned char>> _frames;  // kept to repeat them if bouncing
+
+  static void appendShort(vector<unsigned char> *out, unsigned value) {
+    out->push_back(value & 0xff);
+    out->push_back(value >> 8);
+  }
+
+ public:
+  /** Writes the header, colour table and looping extension. */
+  GifStream(OutputFile *out, int width, int height,
+            const vector<array<unsigned char, 3>> &palette, bool bounce)
+      : _out(out), _width(width), _height(height), _bounce(bounce) {
+    assert(palette.size() <= 256);
+    vector<unsigned char> header = {'G', 'I', 'F', '8', '9', 'a'};
+    appendShort(&header, width);
+    appendShort(&header, height);
+    // 256-entry global colour table of 8-bit channels, background 0, square
+    // pixels
+    header.insert(header.end(), {0xf7, 0, 0});
+    for (int i = 0; i < 256; ++i) {
+      if (i < int(palette.size())) {
+        header.insert(header.end(), palette[i].begin(), palette[i].end());
+      } else {
+        header.insert(header.end(), {0, 0, 0});
+      }
+    }
+    // NETSCAPE2.0 application extension: loop forever
+    static const unsigned char LOOP[] = {0x21, 0xff, 11,  'N', 'E', 'T', 'S',
+                                         'C',  'A',  'P', 'E', '2', '.', '0',
+                                         3,    1,    0,   0,   0};
+    header.insert(header.end(), LOOP, LOOP + sizeof LOOP);
+    _out->write(header.data(), header.size());
+  }
+
+  /** Compresses the next n rows of palette indices of the current frame. */
+  void addRows(const unsigned char *rows, int n) {
+    assert(_y + n <= _height);
+    const size_t size = size_t(_width) * n;
+    const size_t partCount = (size + LZW_PART_SIZE - 1) / LZW_PART_SIZE;
+    vector<BitWriter> parts(partCount);
+    parallelFor(partCount, [&](size_t i) {
+      const size_t start = i * LZW_PART_SIZE;
+      const size_t end = std::min(start + LZW_PART_SIZE, size);
+      lzwCompress(rows + start, end - start, _y == 0 && i == 0,
+                  _y + n == _height && i == partCount - 1, &parts[i]);
+    });
+    for (const auto &part : parts) {
+      _frame.append(part);
+    }
+    _y += n;
+  }
+
+  /** Writes the frame once all its rows have been added. */
+  void endFrame() {
+    assert(_y == _height);
+    vector<unsigned char> frame = {
+        // Graphic control extension: no disposal, no transparency
+        0x21, 0xf9, 4, 0, FRAME_DELAY, 0, 0, 0,
+        // Image descriptor: the whole screen, no local colour table
+        0x2c, 0, 0, 0, 0};
+    appendShort(&frame, _width);
+    appendShort(&frame, _height);
+    frame.push_back(0);
+    frame.push_back(8);  // LZW minimum code size
+    const vector<unsigned char> &data = _frame.flush();
+    for (size_t i = 0; i < data.size(); i += 255) {
+      const size_t block = std::min<size_t>(255, data.size() - i);
+      frame.push_back(block);
+      frame.insert(frame.end(), data.begin() + i, data.begin() + i + block);
+    }
+    frame.push_back(0);
+    _out->write(frame.data(), frame.size());
+    if (_bounce) _frames.push_back(std::move(frame));
+    _frame = BitWriter();
+    _y = 0;
+  }
+
+  /** Writes the frames again backwards if bouncing, then the trailer. */
+  void finish() {
+    for (auto frame = _frames.rbegin(); frame != _frames.rend(); ++frame) {
+      _out->write(frame->data(), frame->size());
+    }
+    static const unsigned char TRAILER[] = {0x3b};
+    _out->write(TRAILER, sizeof TRAILER);
+  }
+};
+
+// Edge of the square tiles of Deep Zoom images, in pixels
+constexpr int DZI_TILE_SIZE = 256;
+
+/**
+ * Deep Zoom image writer fed full-resolution RGB rows a band of at most
+ * DZI_TILE_SIZE rows at a time, top to bottom. For a fileName of name.dzi
+ * it writes the tiles of level L, column c and row r as PNGs named
+ * name_files/L/c_r.png, and name.dzi last of all. Each level keeps one band
+ * of rows: once it is full, or holds the level's last rows, its tiles are
+ * encoded on all cores and it is box-filtered into the level half its size,
+ * so memory is bounded by about two bands of the full-resolution level
+ * however tall the image. Errors are thrown as lodepng error codes.
+ */
+class DziWriter {
+  struct Level {
+    int width;
+    int height;
+    int row = 0;  // rows of the level received so far
+    vector<unsigned char> band;  // the rows of the current row of tiles
+  };
+
+  const string _fileName;
+  const string _filesDir;
+  const Compression _compression;
+  vector<Level> _levels;  // indexed by level number, the last full size
+
+  void encodeTile(int level, int column, int tileRow,
+                  const unsigned char *pixels, int stride, int width,
+                  int height, vector<unsigned char> *png) const {
+    lodepng::State state;
+    for (LodePNGColorMode *mode : {&state.info_raw, &state.info_png.color}) {
+      mode->colortype = LCT_RGB;
+      mode->bitdepth = 8;
+    }
+    state.encoder.auto_convert = 0;
+    setCompression(_compression, &state.encoder);
+    vector<unsigned char> tile(size_t(width) * height * 3);
+    for (int y = 0; y < height; ++y) {
+      memcpy(&tile[size_t(y) * width * 3], pixels + size_t(y) * stride,
+             size_t(width) * 3);
+    }
+    png->clear();
+    const unsigned error =
+        lodepng::encode(*png, tile.data(), width, height, state);
+    if (error) throw error;
+    const string name = _filesDir + "/" + std::to_string(level) + "/" +
+                        std::to_string(column) + "_" +
+                        std::to_string(tileRow) + ".png";
+    OutputFile out(name.c_str());
+    out.write(png->data(), png->size());
+    out.close();
+  }
+
+  /** Writes the tiles of the band of level, then halves it into the next. */
+  void flush(int level) {
+    Level &l = _levels[level];
+    const int rows = l.band.size() / (size_t(l.width) * 3);
+    const int tileRow = (l.row - 1) / DZI_TILE_SIZE;
+    const size_t columns = (l.width + DZI_TILE_SIZE - 1) / DZI_TILE_SIZE;
+    vector<unsigned> errors(columns, 0);
+    parallelFor(columns, [&](size_t column) {
+      const int x0 = column * DZI_TILE_SIZE;
+      vector<unsigned char> png;
+      try {
+        encodeTile(level, column, tileRow, &l.band[size_t(x0) * 3],
+                   l.width * 3, std::min(DZI_TILE_SIZE, l.width - x0), rows,
+                   &png);
+      } catch (unsigned error) {
+        errors[column] = error;
+      }
+    });
+    for (unsigned error : errors) {
+      if (error) throw error;
+    }
+    if (level > 0) {
+      // Each pixel of the next level is the mean of up to 2x2 pixels here,
+      // the last row and column repeated where the size is odd.
+      const int width = _levels[level - 1].width;
+      vector<unsigned char> half(size_t(width) * ((rows + 1) / 2) * 3);
+      parallelFor((rows + 1) / 2, [&](size_t y) {
+        const unsigned char *above = &l.band[2 * y * l.width * 3];
+        const unsigned char *below =
+            2 * y + 1 < size_t(rows) ? above + size_t(l.width) * 3 : above;
+        unsigned char *out = &half[y * width * 3];
+        for (int x = 0; x < width; ++x) {
+          const int left = 2 * x * 3;
+          const int right = 2 * x + 1 < l.width ? left + 3 : left;
+          for (int c = 0; c < 3; ++c) {
+            out[3 * x + c] = (above[left + c] + above[right + c] +
+                              below[left + c] + below[right + c] + 2) >>
+                             2;
+          }
+        }
+      });
+      l.band.clear();
+      addRows(level - 1, half.data(), (rows + 1) / 2);
+    } else {
+      l.band.clear();
+    }
+  }
+
+  /** name_files for a fileName of name.dzi, or of name. */
+  static string filesDir(const string &fileName) {
+    const size_t dot = fileName.rfind('.');
+    const size_t slash = fileName.rfind('/');
+    const bool extension = dot != string::npos &&
+                           (slash == string::npos || dot > slash);
+    return (extension ? fileName.substr(0, dot) : fileName) + "_files";
+  }
+
+  void addRows(int level, const unsigned char *rgb, int n) {
+    Level &l = _levels[level];
+    l.band.insert(l.band.end(), rgb, rgb + size_t(l.width) * n * 3);
+    l.row += n;
+    if (l.row % DZI_TILE_SIZE == 0 || l.row == l.height) flush(level);
+  }
+
+ public:
+  DziWriter(const char *fileName, int width, int height,
+            Compression compression)
+      : _fileName(fileName),
+        _filesDir(filesDir(_fileName)),
+        _compression(compression) {
+    // Halving down to a single pixel
+    for (;;) {
+      _levels.insert(_levels.begin(), Level{width, height, 0, {}});
+      if (width == 1 && height == 1) break;
+      width = (width + 1) / 2;
+      height = (height + 1) / 2;
+    }
+    mkdir(_filesDir.c_str(), 0777);  // if need be
+    for (size_t level = 0; level < _levels.size(); ++level) {
+      mkdir((_filesDir + "/" + std::to_string(level)).c_str(), 0777);
+    }
+  }
+
+  /**
+   * Adds the next n full-resolution rows, which must not cross a row of
+   * tiles.
+   */
+  void addRows(const unsigned char *rgb, int n) {
+    const int level = _levels.size() - 1;
+    assert(_levels[level].row % DZI_TILE_SIZE + n <= DZI_TILE_SIZE);
+    addRows(level, rgb, n);
+  }
+
+  /** Writes the descriptor, once all the rows have been added. */
+  void finish() {
+    const Level &full = _levels.back();
+    assert(full.row == full.height);
+    stringstream xml;
+    xml << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+        << "TileSize=\"" << DZI_TILE_SIZE << "\" Overlap=\"0\" "
+        << "Format=\"png\">\n"
+        << "  <Size Width=\"" << full.width << "\" Height=\"" << full.height
+        << "\"/>\n"
+        << "</Image>\n";
+    const string text = xml.str();
+    OutputFile out(_fileName.c_str());
+    out.write(reinterpret_cast<const unsigned char *>(text.data()),
+              text.size());
+    out.close();
+  }
+};
+
+/**
+ * Counts the finished tiles in each row of tiles, so that a consumer can wait
+ * for the image to be complete down to a given row while tiles further down
+ * are still being worked on.
+ */
+class TileRowProgress {
+  const int _height;
+  vector<int> _remaining;  // unfinished tiles per row of tiles
+  int _completeRows = 0;
+  mutex _mutex;
+  condition_variable _changed;
+
+ public:
+  TileRowProgress(int width, int height)
+      : _height(height),
+        _remaining((height + TILE_MASK) >> TILE_BITS,
+                   (width + TILE_MASK) >> TILE_BITS) {}
+
+  /** Records that the tile with top edge y0 is finished. */
+  void tileDone(int y0) {
+    lock_guard<mutex> lock(_mutex);
+    --_remaining[y0 >> TILE_BITS];
+    size_t row = _completeRows >> TILE_BITS;
+    while (row < _remaining.size() && _remaining[row] == 0) ++row;
+    const int complete = std::min(int(row << TILE_BITS), _height);
+    if (complete != _completeRows) {
+      _completeRows = complete;
+      _changed.notify_all();
+    }
+  }
+
+  /** Waits for the image to be complete down to row y. */
+  void waitFor(int y) {
+    unique_lock<mutex> lock(_mutex);
+    _changed.wait(lock, [&] { return _completeRows > y; });
+  }
+};
+
+class Image {
+  const int _width;
+  const int _height;
+  const Layout _layout;
+  const int _tilesAcross;
+  // Bytes per pixel: 3 for RGB, 1 for palette indices. Either way it is the
+  // PNG colour type written, so lodepng neither scans nor converts pixels.
+  const int _channels;
+  vector<int> _ownIterations;  // empty if the counts are borrowed
+  const int *const _iterations;
+  unsigned char *const _pixels;
+
+  // Buffer length in pixels, rounded up to whole tiles if tiled
+  static size_t area(int width, int height, Layout layout) {
+    if (layout == Layout::ROWS) return size_t(width) * height;
+    return size_t((width + TILE_MASK) & ~TILE_MASK) *
+           ((height + TILE_MASK) & ~TILE_MASK);
+  }
+
+  size_t index(int ix, int iy) const {
+    if (_layout == Layout::ROWS) return ix + size_t(_width) * iy;
+    const size_t tile =
+        size_t(iy >> TILE_BITS) * _tilesAcross + (ix >> TILE_BITS);
+    return tile << (2 * TILE_BITS) | (iy & TILE_MASK) << TILE_BITS |
+           (ix & TILE_MASK);
+  }
+
+  /**
+   * Shades n pixels of a row given the rows above and below it, where
+   * element -1 and n of each row are the left and right neighbours.
+   *
+   * Instead of the textbook
+   *    slope = atan(Z * |grad|), aspect = atan2(dzdy, -dzdx)
+   *    shade = cos(ZENITH)cos(slope) + sin(ZENITH)sin(slope)cos(AZIMUTH-aspect)
+   * this uses cos(atan(s)) = 1/sqrt(1+s^2), sin(atan(s)) = s/sqrt(1+s^2) and
+   * expands cos(AZIMUTH-aspect) in terms of dzdx/|grad| and dzdy/|grad|,
+   * giving
+   *    shade = (cos(ZENITH)
+   *             + Z sin(ZENITH) (sin(AZIMUTH) dzdy - cos(AZIMUTH) dzdx))
+   *            / sqrt(1 + Z^2 |grad|^2)
+   * which is exact, so it differs from the trig version only by rounding
+   * (below 1e-15 in practice). Where the gradient is zero, as in flat bands
+   * and the interior, the result is just cos(ZENITH).
+   */
+  static void shadeRow(const int *above, const int *row, const int *below,
+                       int n, const Shading &shading, double *out) {
+    alignas(16) int gx[TILE_SIZE];
+    alignas(16) int gy[TILE_SIZE];
+    int nonZero = 0;
+    for (int k = 0; k < n; ++k) {
+      gx[k] = (above[k + 1] + 2 * row[k + 1] + below[k + 1]) -
+              (above[k - 1] + 2 * row[k - 1] + below[k - 1]);
+      gy[k] = (below[k - 1] + 2 * below[k] + below[k + 1]) -
+              (above[k - 1] + 2 * above[k] + above[k + 1]);
+      nonZero |= gx[k] | gy[k];
+    }
+    if (nonZero == 0) {
+      std::fill(out, out + n, shading.cosZenith);
+      return;
+    }
+
+    int k = 0;
+#ifdef __SSE2__
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d one = _mm_set1_pd(1);
+    const __m128d cosZenith = _mm_set1_pd(shading.cosZenith);
+    const __m128d kx = _mm_set1_pd(shading.gx);
+    const __m128d ky = _mm_set1_pd(shading.gy);
+    const __m128d k2 = _mm_set1_pd(shading.g2);
+    for (; k + 2 <= n; k += 2) {
+      const __m128d x = _mm_cvtepi32_pd(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(gx + k)));
+      const __m128d y = _mm_cvtepi32_pd(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(gy + k)));
+      const __m128d num = _mm_add_pd(
+          cosZenith, _mm_add_pd(_mm_mul_pd(kx, x), _mm_mul_pd(ky, y)));
+      const __m128d den = _mm_sqrt_pd(_mm_add_pd(
+          one,
+          _mm_mul_pd(k2, _mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y)))));
+      _mm_storeu_pd(out + k, _mm_max_pd(_mm_div_pd(num, den), zero));
+    }
+#endif
+    for (; k < n; ++k) {
+      const double x = gx[k];
+      const double y = gy[k];
+      const double value = (shading.cosZenith + shading.gx * x +
+                            shading.gy * y) /
+                           sqrt(1 + shading.g2 * (x * x + y * y));
+      out[k] = value < 0 ? 0 : value;
+    }
+  }
+
+ public:
+  Image(int width, int height, Layout layout, int channels)
+      : _width(width),
+        _height(height),
+        _layout(layout),
+        _tilesAcross((width + TILE_MASK) >> TILE_BITS),
+        _channels(channels),
+        _ownIterations(area(width, height, layout)),
+        _iterations(_ownIterations.data()),
+        _pixels(new unsigned char[area(width, height, layout) * channels]) {}
+  /**
+   * An image in rows over the row-major counts in iterations, which must
+   * outlive it, such as those of an IterationsFile. They are only read, to
+   * be coloured.
+   */
+  Image(int width, int height, const int *iterations, int channels)
+      : _width(width),
+        _height(height),
+        _layout(Layout::ROWS),
+        _tilesAcross((width + TILE_MASK) >> TILE_BITS),
+        _channels(channels),
+        _iterations(iterations),
+        _pixels(new unsigned char[area(width, height, _layout) * channels]) {}
+  Image(const Image &) = delete;
+  Image &operator=(const Image &) = delete;
+  ~Image() { delete[] _pixels; }
+
+  int width() const { return _width; }
+  int height() const { return _height; }
+
+  int iterations(int ix, int iy) const { return _iterations[index(ix, iy)]; }
+
+  /**
+   * Iterations from (ix, iy) onwards, contiguous in either layout up to the
+   * end of the row within the tile containing ix.
+   */
+  const int *iterationsSpan(int ix, int iy) const {
+    return &_iterations[index(ix, iy)];
+  }
+
+  /** As iterationsSpan, to compute into, of an image that owns its counts. */
+  int *writableIterationsSpan(int ix, int iy) {
+    assert(!_ownIterations.empty());
+    return &_ownIterations[index(ix, iy)];
+  }
+
+  /**
+   * Packed RGB or palette indices from (ix, iy) onwards, contiguous like
+   * iterationsSpan.
+   */
+  void setPixels(int ix, int iy, const unsigned char *pixels, int n) {
+    memcpy(&_pixels[_channels * index(ix, iy)], pixels, size_t(n) * _channels);
+  }
+
+  int centerIterations() { return iterations(_width / 2, _height / 2); }
+
+  /** Copies the iterations of row iy, whatever the layout, to out. */
+  void iterationsRow(int iy, int *out) const {
+    const int step = _layout == Layout::ROWS ? _width : TILE_SIZE;
+    for (int ix = 0; ix < _width; ix += step) {
+      memcpy(out + ix, iterationsSpan(ix, iy),
+             std::min(step, _width - ix) * sizeof *out);
+    }
+  }
+
+  /** https://pro.arcgis.com/en/pro-app/latest/tool-reference/3d-analyst/how-hillshade-works.htm
+   * https://blog.datawrapper.de/shaded-relief-with-gdal-python/
+   *
+   * Hill-shades the tile [x0,x1)x[y0,y1), which must lie within one
+   * TILE_SIZE-aligned tile, lit as shading describes, into shade with a row
+   * stride of TILE_SIZE.
+   * Pixels on the image border have no full neighbourhood and get zero.
+   */
+  void hillshade(int x0, int y0, int x1, int y1, const Shading &shading,
+                 double *shade) const {
+    // Stage the tile plus a one-pixel halo, clamped at the image border,
+    // so the filter reads one compact block whatever the layout.
+    constexpr int STRIDE = TILE_SIZE + 2;
+    int block[STRIDE * STRIDE];
+    const int n = x1 - x0;
+    for (int by = 0; by < y1 - y0 + 2; ++by) {
+      const int iy = std::min(std::max(y0 - 1 + by, 0), _height - 1);
+      int *dst = block + by * STRIDE;
+      dst[0] = iterations(std::max(x0 - 1, 0), iy);
+      memcpy(dst + 1, iterationsSpan(x0, iy), n * sizeof *dst);
+      dst[n + 1] = iterations(std::min(x1, _width - 1), iy);
+    }
+    for (int iy = y0; iy < y1; ++iy) {
+      double *out = shade + (iy - y0) * TILE_SIZE;
+      if (iy == 0 || iy == _height - 1) {
+        std::fill(out, out + n, 0.0);
+        continue;
+      }
+      const int *above = block + (iy - y0) * STRIDE + 1;
+      shadeRow(above, above + STRIDE, above + 2 * STRIDE, n, shading, out);
+      if (x0 == 0) out[0] = 0;
+      if (x1 == _width) out[n - 1] = 0;
+    }
+  }
+
+  /**
+   * Rows [y0,y1) of pixels in row-major order, de-tiled into scratch if need
+   * be.
+   */
+  const unsigned char *rowMajorPixels(int y0, int y1,
+                                      vector<unsigned char> *scratch) const {
+    if (_layout == Layout::ROWS) return &_pixels[_channels * index(0, y0)];
+    scratch->resize(size_t(_width) * (y1 - y0) * _channels);
+    unsigned char *dst = scratch->data();
+    for (int iy = y0; iy < y1; ++iy) {
+      for (int ix = 0; ix < _width; ix += TILE_SIZE) {
+        const size_t bytes = std::min(TILE_SIZE, _width - ix) * _channels;
+        memcpy(dst, &_pixels[_channels * index(ix, iy)], bytes);
+        dst += bytes;
+      }
+    }
+    return scratch->data();
+  }
+
+  /**
+   * Calls f(pixels, n) with the next n rows in row-major order for fixed
+   * batches of at most batch rows, top to bottom, each as soon as progress
+   * reports it finished, while the rest of the image is still being coloured.
+   */
+  template <typename F>
+  void forEachBatch(TileRowProgress *progress, int batch, F f) const {
+    vector<unsigned char> rows;
+    for (int y = 0; y < _height; y += batch) {
+      const int end = std::min(y + batch, _height);
+      progress->waitFor(end - 1);
+      f(rowMajorPixels(y, end, &rows), end - y);
+    }
+  }
+
+  /**
+   * As forEachBatch, but with palette indices looked up in palette, if it is
+   * not empty, so f always gets RGB.
+   */
+  template <typename F>
+  void forEachRgbBatch(TileRowProgress *progress, int batch,
+                       const vector<array<unsigned char, 3>> &palette,
+                       F f) const {
+    vector<unsigned char> rgb;
+    forEachBatch(progress, batch, [&](const unsigned char *rows, int n) {
+      if (!palette.empty()) {
+        const size_t count = size_t(_width) * n;
+        rgb.resize(3 * count);
+        for (size_t i = 0; i < count; ++i) {
+          memcpy(&rgb[3 * i], palette[rows[i]].data(), 3);
+        }
+        rows = rgb.data();
+      }
+      f(rows, n);
+    });
+  }
+
+  /**
+   * Writes RGB pixels, or palette indices into palette if it is not empty, as
+   * a PNG to out. Rows are encoded in fixed batches, so the output does not
+   * depend on timing. Errors are thrown as lodepng error codes.
+   */
+  template <typename T>
+  void writePng(const Params<T> &params,
+                const vector<array<unsigned char, 3>> &palette,
+                TileRowProgress *progress, OutputFile *out) const {
+    lodepng::State state;
+    initPngState(params, palette, &state);
+
+    PngStream png(out, state, _width, _height);
+    // Whole rows of tiles, as many as give each core a part to deflate
+    const size_t rowBytes = size_t(_width) * _channels;
+    const int batch = std::max<int>(
+        TILE_SIZE, (threadCount * DEFLATE_PART_SIZE / rowBytes) & ~TILE_MASK);
+    forEachBatch(progress, batch, [&](const unsigned char *rows, int n) {
+      png.addRows(rows, n);
+    });
+    png.finish();
+  }
+
+  /** Writes the pixels as a QOI image to out in the same way as writePng. */
+  void writeQoi(const vector<array<unsigned char, 3>> &palette,
+                TileRowProgress *progress, OutputFile *out) const {
+    QoiStream qoi(out, _width, _height);
+    forEachRgbBatch(progress, TILE_SIZE, palette,
+                    [&](const unsigned char *rgb, int n) {
+                      qoi.addPixels(rgb, size_t(_width) * n);
+                    });
+    qoi.finish();
+  }
+
+  /** Writes the pixels as a JPEG to out in the same way as writePng. */
+  void writeJpeg(const vector<array<unsigned char, 3>> &palette,
+                 TileRowProgress *progress, OutputFile *out) const {
+    JpegStream jpeg(out, _width, _height, JPEG_QUALITY);
+    // Whole rows of tiles, with rows of MCUs for each core to encode
+    const int batch = std::max<int>(
+        TILE_SIZE,
+        (threadCount * 2 * JpegStream::MCU_SIZE + TILE_MASK) & ~TILE_MASK);
+    forEachRgbBatch(progress, batch, palette,
+                    [&](const unsigned char *rgb, int n) {
+                      jpeg.addRows(rgb, n);
+                    });
+    jpeg.finish();
+  }
+
+  /** Writes the pixels as the next frame of an animated PNG. */
+  void writeFrame(TileRowProgress *progress, PngStream *apng) const {
+    forEachBatch(progress, _height, [&](const unsigned char *frame, int) {
+      apng->addFrame(frame);
+    });
+  }
+
+  /** Writes the palette indices as the next frame of a GIF in the same way. */
+  void writeFrame(TileRowProgress *progress, GifStream *gif) const {
+    assert(_channels == 1);
+    // Whole rows of tiles, as many as give each core a part to compress
+    const int batch = std::max<int>(
+        TILE_SIZE, (threadCount * LZW_PART_SIZE / _width) & ~TILE_MASK);
+    forEachBatch(progress, batch, [&](const unsigned char *rows, int n) {
+      gif->addRows(rows, n);
+    });
+    gif->endFrame();
+  }
+
+  /** Writes the pixels as the next frame of video in the same way. */
+  void writeFrame(const vector<array<unsigned char, 3>> &palette,
+                  TileRowProgress *progress, VideoStream *video) const {
+    forEachRgbBatch(progress, TILE_SIZE, palette,
+                    [&](const unsigned char *rgb, int n) {
+                      video->addRows(rgb, n);
+                    });
+    video->endFrame();
+  }
+};
+
+// Views with pixels closer together than this are rendered by perturbation
+// against a reference orbit: two pixels at a time in doubles is faster than
+// iterating every pixel in long double, and stays accurate where long double
+// can no longer tell neighbouring pixels apart.
+constexpr double PERTURBATION_SCALE = 1e-12;
+
+#ifdef __SIZEOF_FLOAT128__
+// Arithmetic of reference orbits, precise enough for views far narrower
+// than the per-pixel arithmetic could resolve
+using OrbitFloat = __float128;
+constexpr int ORBIT_DIGITS = __FLT128_MANT_DIG__;
+#else
+using OrbitFloat = long double;
+constexpr int ORBIT_DIGITS = numeric_limits<long double>::digits;
+#endif
+
+/** Whether the view of params is rendered by perturbation. */
+template <typename T>
+bool isDeep(const Params<T> &params) {
+  return params.width / params.HD_IMG_WIDTH < PERTURBATION_SCALE;
+}
+
+/*
+ * Iteration files hold the iteration counts of a render, the expensive part
+ * of it, with the view they are of, to be coloured again without computing
+ * them. All numbers are little-endian. A 256-byte header
+ *
+ *   offset  size
+ *        0     8  magic "ABITERS\0"
+ *        8     4  format version, ITERATIONS_VERSION
+ *       12     4  header size, a multiple of 64, where the payload starts
+ *       16     4  width in pixels
+ *       20     4  height in pixels
+ *       24     4  maximum iteration count
+ *       28     4  mantissa bits of the arithmetic of the view: of the type
+ *                 the counts were computed in, or of the reference orbit
+ *                 if by perturbation
+ *       32     4  encoding of the payload, IterationsEncoding
+ *       36     4  rows per band of a DELTA_DEFLATE payload
+ *       40     8  payload size in bytes
+ *       48    48  real part of the centre, as decimal text padded with NULs
+ *       96    48  imaginary part of the centre, likewise
+ *      144    48  width of the view, likewise
+ *      192     4  mantissa bits of the per-pixel arithmetic of perturbation,
+ *                 against the reference orbit, or 0 if not by perturbation
+ *
+ * is followed by the payload. RAW is the counts as 32-bit integers in
+ * row-major order, aligned so that a mapped file can be read in place.
+ * DELTA_DEFLATE is, for each band of rows, the offset of its data from the
+ * start of the payload, and one more offset for the end, as 64-bit integers,
+ * followed by the bands' data. Each band is a zlib stream of the differences
+ * of the counts in row-major order from their left neighbours (from the one
+ * above at the start of a row, after the band's first), zigzag encoded as
+ * unsigned LEB128 varints, so bands are encoded and decoded independently.
+ */
+constexpr char ITERATIONS_MAGIC[8] = {'A', 'B', 'I', 'T', 'E', 'R', 'S', 0};
+constexpr unsigned ITERATIONS_VERSION = 1;
+constexpr size_t ITERATIONS_HEADER_SIZE = 256;
+constexpr size_t ITERATIONS_TEXT_SIZE = 48;
+enum class IterationsEncoding : unsigned { RAW = 0, DELTA_DEFLATE = 1 };
+
+/** Iteration file encoding chosen by the extension of fileName. */
+IterationsEncoding iterationsEncodingOf(const char *fileName) {
+  const char *extension = strrchr(fileName, '.');
+  return extension && strcmp(extension, ".iterz") == 0
+             ? IterationsEncoding::DELTA_DEFLATE
+             : IterationsEncoding::RAW;
+}
+
+void appendLittleEndian(vector<unsigned char> *out, uint64_t value,
+                        int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out->push_back(value >> (8 * i));
+  }
+}
+
+uint64_t readLittleEndian(const unsigned char *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes - 1; i >= 0; --i) {
+    value = value << 8 | in[i];
+  }
+  return value;
+}
+
+/**
+ * Appends value as decimal text that reads back as exactly value, padded
+ * with NULs to size bytes.
+ */
+template <typename T>
+void appendText(vector<unsigned char> *out, T value, size_t size) {
+  stringstream text;
+  text.precision(numeric_limits<T>::max_digits10);
+  text << value;
+  const string digits = text.str();
+  assert(digits.size() < size);
+  out->insert(out->end(), digits.begin(), digits.end());
+  out->resize(out->size() + size - digits.size());
+}
+
+/**
+ * Writes the iteration counts of img, rendered with params, as an iteration
+ * file to out, the bands of a compressed one encoded on all cores. Errors
+ * are thrown as lodepng error codes.
+ */
+template <typename T>
+void writeIterations(const Params<T> &params, const Image &img,
+                     IterationsEncoding encoding, OutputFile *out) {
+  const int width = params.HD_IMG_WIDTH;
+  const int height = params.HD_IMG_HEIGHT;
+  vector<unsigned char> payload;
+  if (encoding == IterationsEncoding::DELTA_DEFLATE) {
+    const size_t bandCount = (height + TILE_SIZE - 1) / TILE_SIZE;
+    vector<vector<unsigned char>> bands(bandCount);
+    vector<unsigned> errors(bandCount, 0);
+    parallelFor(bandCount, [&](size_t band) {
+      const int y0 = band * TILE_SIZE;
+      const int y1 = std::min(y0 + TILE_SIZE, height);
+      vector<int> above(width);
+      vector<int> row(width);
+      vector<unsigned char> varints;
+      for (int iy = y0; iy < y1; ++iy) {
+        img.iterationsRow(iy, row.data());
+        for (int ix = 0; ix < width; ++ix) {
+          const int predicted =
+              ix > 0 ? row[ix - 1] : iy > y0 ? above[0] : 0;
+          const int delta = row[ix] - predicted;
+          unsigned zigzag = unsigned(delta) << 1 ^ unsigned(delta >> 31);
+          for (; zigzag >= 0x80; zigzag >>= 7) {
+            varints.push_back(zigzag | 0x80);
+          }
+          varints.push_back(zigzag);
+        }
+        row.swap(above);
+      }
+      LodePNGCompressSettings settings;
+      lodepng_compress_settings_init(&settings);
+      settings.match_strategy = LMS_GREEDY;
+      settings.windowsize = 32768;
+      unsigned char *compressed = nullptr;
+      size_t compressedSize = 0;
+      errors[band] = lodepng_zlib_compress(&compressed, &compressedSize,
+                                           varints.data(), varints.size(),
+                                           &settings);
+      unique_ptr<unsigned char, void (*)(void *)> owner(compressed, free);
+      if (!errors[band]) {
+        bands[band].assign(compressed, compressed + compressedSize);
+      }
+    });
+    for (unsigned error : errors) {
+      if (error) throw error;
+    }
+    uint64_t offset = 8 * (bandCount + 1);
+    for (const auto &band : bands) {
+      appendLittleEndian(&payload, offset, 8);
+      offset += band.size();
+    }
+    appendLittleEndian(&payload, offset, 8);
+    for (const auto &band : bands) {
+      payload.insert(payload.end(), band.begin(), band.end());
+    }
+  }
+  const uint64_t payloadSize = encoding == IterationsEncoding::RAW
+                                   ? uint64_t(width) * height * 4
+                                   : payload.size();
+
+  vector<unsigned char> header(ITERATIONS_MAGIC, ITERATIONS_MAGIC + 8);
+  appendLittleEndian(&header, ITERATIONS_VERSION, 4);
+  appendLittleEndian(&header, ITERATIONS_HEADER_SIZE, 4);
+  appendLittleEndian(&header, width, 4);
+  appendLittleEndian(&header, height, 4);
+  appendLittleEndian(&header, params.maxIterationCount, 4);
+  const bool deep = isDeep(params);
+  appendLittleEndian(&header, deep ? ORBIT_DIGITS : numeric_limits<T>::digits,
+                     4);
+  appendLittleEndian(&header, unsigned(encoding), 4);
+  appendLittleEndian(
+      &header, encoding == IterationsEncoding::RAW ? 0 : TILE_SIZE, 4);
+  appendLittleEndian(&header, payloadSize, 8);
+  for (const T value : {params.centerRe, params.centerIm, params.width}) {
+    appendText(&header, value, ITERATIONS_TEXT_SIZE);
+  }
+  appendLittleEndian(&header, deep ? numeric_limits<double>::digits : 0, 4);
+  header.resize(ITERATIONS_HEADER_SIZE);
+  out->write(header.data(), header.size());
+
+  if (encoding == IterationsEncoding::RAW) {
+    vector<int> row(width);
+    vector<unsigned char> bytes;
+    for (int iy = 0; iy < height; ++iy) {
+      img.iterationsRow(iy, row.data());
+      bytes.clear();
+      for (const int iters : row) {
+        appendLittleEndian(&bytes, iters, 4);
+      }
+      out->write(bytes.data(), bytes.size());
+    }
+  } else {
+    out->write(payload.data(), payload.size());
+  }
+}
+
+/**
+ * An iteration file opened for reading. It is mapped into memory, and a RAW
+ * payload is used in place, so that loading the counts costs no copy and
+ * only the pages read are read from disk. A compressed one is decoded on all
+ * cores. Errors are thrown as runtime_error.
+ */
+class IterationsFile {
+  /**
+   * A copy-on-write mapping of a whole file, so writes change only this
+   * process's view, unmapped when destroyed.
+   */
+  struct Mapping {
+    unsigned char *data = nullptr;
+    size_t size = 0;
+    ~Mapping() {
+      if (data) munmap(data, size);
+    }
+  };
+
+  const string _fileName;
+  Mapping _mapping;
+  int _width;
+  int _height;
+  int _maxIterationCount;
+  int _digits;
+  string _text[3];  // centre real and imaginary parts, view width
+  const int *_iterations = nullptr;
+  vector<int> _decoded;  // the counts, if they cannot be used in place
+
+  [[noreturn]] void fail(const string &problem) const {
+    throw std::runtime_error(_fileName + ": " + problem);
+  }
+
+  /** Decodes a DELTA_DEFLATE payload of size bytes into _decoded. */
+  void decode(const unsigned char *payload, uint64_t size, int bandRows) {
+    if (bandRows <= 0) fail("bad band height");
+    const size_t bandCount = (_height + bandRows - 1) / bandRows;
+    if (size < 8 * (bandCount + 1)) fail("truncated band table");
+    _decoded.resize(size_t(_width) * _height);
+    vector<unsigned char> failed(bandCount, 0);
+    parallelFor(bandCount, [&](size_t band) {
+      const uint64_t begin = readLittleEndian(payload + 8 * band, 8);
+      const uint64_t end = readLittleEndian(payload + 8 * band + 8, 8);
+      unsigned char *varints = nullptr;
+      size_t count = 0;
+      const unsigned error =
+          begin > end || end > size
+              ? 1
+              : lodepng_zlib_decompress(&varints, &count, payload + begin,
+                                        end - begin,
+                                        &lodepng_default_decompress_settings);
+      unique_ptr<unsigned char, void (*)(void *)> owner(varints, free);
+      if (error) {
+        failed[band] = 1;
+        return;
+      }
+      const int y0 = band * bandRows;
+      const int y1 = std::min(y0 + bandRows, _height);
+      int *counts = &_decoded[size_t(y0) * _width];
+      const unsigned char *in = varints;
+      const unsigned char *const inEnd = varints + count;
+      for (size_t i = 0; i < size_t(y1 - y0) * _width; ++i) {
+        unsigned zigzag = 0;
+        for (int shift = 0;; shift += 7) {
+          if (in == inEnd || shift > 28) {
+            failed[band] = 1;
+            return;
+          }
+          zigzag |= unsigned(*in & 0x7f) << shift;
+          if (!(*in++ & 0x80)) break;
+        }
+        const int delta = int(zigzag >> 1) ^ -int(zigzag & 1);
+        const int predicted = i % _width > 0 ? counts[i - 1]
+                              : i > 0        ? counts[i - _width]
+                                             : 0;
+        counts[i] = predicted + delta;
+      }
+      if (in != inEnd) failed[band] = 1;
+    });
+    for (const unsigned char bad : failed) {
+      if (bad) fail("corrupt band");
+    }
+    _iterations = _decoded.data();
+  }
+
+ public:
+  explicit IterationsFile(const char *fileName) : _fileName(fileName) {
+    const int fd = open(fileName, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+      const int error = errno;
+      if (fd >= 0) ::close(fd);
+      fail(strerror(error));
+    }
+    if (size_t(status.st_size) < ITERATIONS_HEADER_SIZE) {
+      ::close(fd);
+      fail("not an iteration file");
+    }
+    void *data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    const int error = errno;
+    ::close(fd);  // the mapping stays
+    if (data == MAP_FAILED) fail(strerror(error));
+    _mapping.data = static_cast<unsigned char *>(data);
+    _mapping.size = status.st_size;
+
+    const unsigned char *header = _mapping.data;
+    if (memcmp(header, ITERATIONS_MAGIC, 8) != 0) {
+      fail("not an iteration file");
+    }
+    if (readLittleEndian(header + 8, 4) != ITERATIONS_VERSION) {
+      fail("unsupported iteration file version");
+    }
+    const uint64_t headerSize = readLittleEndian(header + 12, 4);
+    const uint64_t width = readLittleEndian(header + 16, 4);
+    const uint64_t height = readLittleEndian(header + 20, 4);
+    const uint64_t maxIterationCount = readLittleEndian(header + 24, 4);
+    _digits = readLittleEndian(header + 28, 4);
+    const uint64_t encoding = readLittleEndian(header + 32, 4);
+    const int bandRows = readLittleEndian(header + 36, 4);
+    const uint64_t payloadSize = readLittleEndian(header + 40, 8);
+    if (headerSize < ITERATIONS_HEADER_SIZE || headerSize % 64 != 0 ||
+        headerSize > _mapping.size ||
+        payloadSize > _mapping.size - headerSize || width == 0 ||
+        width > INT_MAX || height == 0 || height > INT_MAX ||
+        maxIterationCount > INT_MAX) {
+      fail("bad iteration file header");
+    }
+    _width = width;
+    _height = height;
+    _maxIterationCount = maxIterationCount;
+    for (int i = 0; i < 3; ++i) {
+      const char *text = reinterpret_cast<const char *>(
+          header + 48 + i * ITERATIONS_TEXT_SIZE);
+      _text[i].assign(text, strnlen(text, ITERATIONS_TEXT_SIZE));
+    }
+
+    const unsigned char *payload = _mapping.data + headerSize;
+    switch (IterationsEncoding(encoding)) {
+      case IterationsEncoding::RAW: {
+        if (payloadSize != width * height * 4) fail("bad payload size");
+        const uint16_t one = 1;
+        if (*reinterpret_cast<const unsigned char *>(&one) == 1) {
+          _iterations = reinterpret_cast<const int *>(payload);
+        } else {
+          _decoded.resize(width * height);
+          for (size_t i = 0; i < _decoded.size(); ++i) {
+            _decoded[i] = readLittleEndian(payload + 4 * i, 4);
+          }
+          _iterations = _decoded.data();
+        }
+        break;
+      }
+      case IterationsEncoding::DELTA_DEFLATE:
+        decode(payload, payloadSize, bandRows);
+        break;
+      default:
+        fail("unknown payload encoding");
+    }
+  }
+  IterationsFile(const IterationsFile &) = delete;
+  IterationsFile &operator=(const IterationsFile &) = delete;
+
+  int width() const { return _width; }
+  int height() const { return _height; }
+  int maxIterationCount() const { return _maxIterationCount; }
+  /** Mantissa bits of the type the counts were computed in. */
+  int digits() const { return _digits; }
+
+  /** The counts in row-major order, valid as long as this object. */
+  const int *iterations() const { return _iterations; }
+
+  /** Sets the view and image size in params to those of the file. */
+  template <typename T>
+  void getParams(Params<T> *params) const {
+    params->HD_IMG_WIDTH = _width;
+    params->HD_IMG_HEIGHT = _height;
+    params->maxIterationCount = _maxIterationCount;
+    params->centerRe = strtold(_text[0].c_str(), nullptr);
+    params->centerIm = strtold(_text[1].c_str(), nullptr);
+    params->width = strtold(_text[2].c_str(), nullptr);
+  }
+};
+
+array<double, 3> hsv2rgb(double h, double s, double v) {
+  double c = v * s;
+  double x = c * (1.0 - fabs(fmod(h / 60.0, 2) - 1.0));
+  double m = v - c;
+  if (h >= 0.0 && h < 60.0) {
+    return {c + m, x + m, m};
+  }
+  if (h >= 60.0 && h < 120.0) {
+    return {x + m, c + m, m};
+  }
+  if (h >= 120.0 && h < 180.0) {
+    return {m, c + m, x + m};
+  }
+  if (h >= 180.0 && h < 240.0) {
+    return {m, x + m, c + m};
+  }
+  if (h >= 240.0 && h < 300.0) {
+    return {x + m, m, c + m};
+  }
+  if (h >= 300.0 && h < 360.0) {
+    return {c + m, m, x + m};
+  }
+  return {m, m, m};
+}
+
+constexpr unsigned char clamp(int color) { return color >= 255 ? 255 : color; }
+
+template <typename T>
+int iterations(int maxIterationCount, T cRe, T cIm) {
+  T zRe = 0;
+  T zIm = 0;
+  T zRe2 = 0;
+  T zIm2 = 0;
+  for (int i = 0; i < maxIterationCount; ++i) {
+    T zReNew = zRe2 - zIm2 + cRe;
+    T zImNew = 2 * zRe * zIm + cIm;
+    zRe2 = zReNew * zReNew;
+    zIm2 = zImNew * zImNew;
+    if (zRe2 + zIm2 > 4) {
+      return i;
+    }
+    zRe = zReNew;
+    zIm = zImNew;
+  }
+  return maxIterationCount;
+}
+
+template <typename T>
+int iterations(const Params<T> &params, int ix, int iy) {
+  T scale = params.width / params.HD_IMG_WIDTH;
+  T cRe = scale * (ix - params.HD_IMG_WIDTH / 2) + params.centerRe;
+  T cIm = scale * (params.HD_IMG_HEIGHT / 2 - iy) + params.centerIm;
+  return iterations(params.maxIterationCount, cRe, cIm);
+}
+
+/*
+ * Orbit files cache reference orbits across runs, as their arithmetic is
+ * slow: a million iterations take a fifth of a second. All numbers are
+ * little-endian. A 256-byte header
+ *
+ *   offset  size
+ *        0     8  magic "ABORBIT\0"
+ *        8     4  format version, ORBIT_VERSION
+ *       12     4  header size, a multiple of 64, where the points start
+ *       16     4  mantissa bits of the arithmetic the orbit was computed in
+ *       20     4  1 if the orbit escaped, so is complete for any iteration
+ *                 count, else 0
+ *       24     8  iterations n
+ *       32    48  real and imaginary parts of the last point Z_n, each as
+ *                 three doubles that sum to it exactly, to extend it from
+ *       80    48  real part of the reference point, as decimal text padded
+ *                 with NULs
+ *      128    48  imaginary part of the reference point, likewise
+ *
+ * is followed by the points Z_0 to Z_n as pairs of doubles, real part
+ * first, which is all perturbation reads of them. Files are named after a
+ * hash of the reference point and mantissa bits.
+ */
+constexpr char ORBIT_MAGIC[8] = {'A', 'B', 'O', 'R', 'B', 'I', 'T', 0};
+constexpr unsigned ORBIT_VERSION = 1;
+constexpr size_t ORBIT_HEADER_SIZE = 256;
+constexpr size_t ORBIT_TEXT_SIZE = 48;
+// Bounds on an orbit cache directory, as finding an orbit in it reads the
+// header of every orbit file: beyond them the least recently used are deleted
+constexpr size_t ORBIT_CACHE_FILES = 64;
+constexpr uint64_t ORBIT_CACHE_BYTES = uint64_t(1) << 30;
+
+/**
+ * Deletes the orbit files in dir least recently used, by modification time,
+ * until at most ORBIT_CACHE_FILES of them are left, of at most
+ * ORBIT_CACHE_BYTES in all.
+ */
+void trimOrbitCache(const char *dir) {
+  struct Entry {
+    timespec used;
+    uint64_t size;
+    string fileName;
+  };
+  vector<Entry> orbits;
+  DIR *entries = opendir(dir);
+  if (!entries) return;
+  while (const dirent *entry = readdir(entries)) {
+    const char *extension = strrchr(entry->d_name, '.');
+    if (!extension || strcmp(extension, ".orbit") != 0) continue;
+    const string fileName = dir + string("/") + entry->d_name;
+    struct stat status;
+    if (stat(fileName.c_str(), &status) == 0) {
+      orbits.push_back({status.st_mtim, uint64_t(status.st_size), fileName});
+    }
+  }
+  closedir(entries);
+  std::sort(orbits.begin(), orbits.end(), [](const Entry &a, const Entry &b) {
+    return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec > b.used.tv_sec
+                                          : a.used.tv_nsec > b.used.tv_nsec;
+  });
+  size_t files = 0;
+  uint64_t bytes = 0;
+  for (const Entry &orbit : orbits) {
+    if (files < ORBIT_CACHE_FILES && bytes + orbit.size <= ORBIT_CACHE_BYTES) {
+      ++files;
+      bytes += orbit.size;
+    } else {
+      unlink(orbit.fileName.c_str());
+    }
+  }
+}
+
+/**
+ * Iterations of the pixel at offset dc from a reference point with orbit
+ * points Z_0 to Z_n, counted as iterations() counts them, computed from just
+ * the difference d of the pixel's orbit from the reference orbit:
+ *    d' = (2 Z + d) d + dc
+ * which stays accurate in doubles however small dc is. Whenever the pixel
+ * comes closer to 0 than to the reference orbit, or the reference orbit
+ * ends, the pixel is rebased onto the start of it, so that one reference
+ * orbit serves the whole view without glitches (Zhuoran, 2021). The state
+ * after i iterations, with d relative to Z_m, may be given to carry on.
+ */
+int perturbedIterations(const double *orbit, int n, int maxIterationCount,
+                        double dcRe, double dcIm, double dRe = 0,
+                        double dIm = 0, int m = 0, int i = 0) {
+  for (; i < maxIterationCount; ++i) {
+    const double aRe = 2 * orbit[2 * m] + dRe;
+    const double aIm = 2 * orbit[2 * m + 1] + dIm;
+    const double re = aRe * dRe - aIm * dIm + dcRe;
+    dIm = aRe * dIm + aIm * dRe + dcIm;
+    dRe = re;
+    ++m;
+    const double zRe = orbit[2 * m] + dRe;
+    const double zIm = orbit[2 * m + 1] + dIm;
+    const double z2 = zRe * zRe + zIm * zIm;
+    if (z2 > 4) return i;
+    if (z2 < dRe * dRe + dIm * dIm || m == n) {
+      dRe = zRe;
+      dIm = zIm;
+      m = 0;
+    }
+  }
+  return maxIterationCount;
+}
+
+/**
+ * perturbedIterations of count pixels in a row, at offsets dcRe[k] and dcIm
+ * from the reference point, into out.
+ */
+void perturbedRow(const double *orbit, int n, int maxIterationCount,
+                  const double *dcRe, double dcIm, int count, int *out) {
+  int k = 0;
+#ifdef __SSE2__
+  // Two pixels at a time, each with its own place m in the reference orbit,
+  // until either is done or rebased; the other is then finished alone.
+  const __m128d two = _mm_set1_pd(2);
+  const __m128d four = _mm_set1_pd(4);
+  const __m128d cIm = _mm_set1_pd(dcIm);
+  for (; k + 2 <= count; k += 2) {
+    const __m128d cRe = _mm_loadu_pd(dcRe + k);
+    __m128d dRe = _mm_setzero_pd();
+    __m128d dIm = _mm_setzero_pd();
+    __m128d zRe = _mm_setzero_pd();
+    __m128d zIm = _mm_setzero_pd();
+    int m[2] = {0, 0};
+    int i = 0;
+    for (;;) {
+      // Steps before either pixel reaches the end of the reference orbit or
+      // of its iterations
+      const int limit = std::min({n - m[0], n - m[1], maxIterationCount - i});
+      const double *orbit0 = orbit + 2 * m[0];
+      const double *orbit1 = orbit + 2 * m[1];
+      __m128d z0 = _mm_loadu_pd(orbit0);
+      __m128d z1 = _mm_loadu_pd(orbit1);
+      int step = 0;
+      while (step < limit) {
+        const __m128d aRe =
+            _mm_add_pd(_mm_mul_pd(two, _mm_unpacklo_pd(z0, z1)), dRe);
+        const __m128d aIm =
+            _mm_add_pd(_mm_mul_pd(two, _mm_unpackhi_pd(z0, z1)), dIm);
+        const __m128d re = _mm_add_pd(
+            _mm_sub_pd(_mm_mul_pd(aRe, dRe), _mm_mul_pd(aIm, dIm)), cRe);
+        dIm = _mm_add_pd(
+            _mm_add_pd(_mm_mul_pd(aRe, dIm), _mm_mul_pd(aIm, dRe)), cIm);
+        dRe = re;
+        ++step;
+        z0 = _mm_loadu_pd(orbit0 + 2 * step);
+        z1 = _mm_loadu_pd(orbit1 + 2 * step);
+        zRe = _mm_add_pd(_mm_unpacklo_pd(z0, z1), dRe);
+        zIm = _mm_add_pd(_mm_unpackhi_pd(z0, z1), dIm);
+        const __m128d z2 =
+            _mm_add_pd(_mm_mul_pd(zRe, zRe), _mm_mul_pd(zIm, zIm));
+        const __m128d d2 =
+            _mm_add_pd(_mm_mul_pd(dRe, dRe), _mm_mul_pd(dIm, dIm));
+        if (_mm_movemask_pd(_mm_or_pd(_mm_cmpgt_pd(z2, four),
+                                      _mm_cmplt_pd(z2, d2)))) {
+          break;
+        }
+      }
+      i += step;
+      alignas(16) double lanes[4][2];
+      _mm_store_pd(lanes[0], dRe);
+      _mm_store_pd(lanes[1], dIm);
+      _mm_store_pd(lanes[2], zRe);
+      _mm_store_pd(lanes[3], zIm);
+      bool done[2] = {false, false};
+      for (int lane = 0; lane < 2; ++lane) {
+        double &laneDRe = lanes[0][lane];
+        double &laneDIm = lanes[1][lane];
+        const double laneZRe = lanes[2][lane];
+        const double laneZIm = lanes[3][lane];
+        const double z2 = laneZRe * laneZRe + laneZIm * laneZIm;
+        m[lane] += step;
+        if (z2 > 4) {
+          out[k + lane] = i - 1;
+          done[lane] = true;
+        } else if (i == maxIterationCount) {
+          out[k + lane] = maxIterationCount;
+          done[lane] = true;
+        } else if (z2 < laneDRe * laneDRe + laneDIm * laneDIm ||
+                   m[lane] == n) {
+          laneDRe = laneZRe;
+          laneDIm = laneZIm;
+          m[lane] = 0;
+        }
+      }
+      if (done[0] || done[1]) {
+        for (int lane = 0; lane < 2; ++lane) {
+          if (done[lane]) continue;
+          out[k + lane] = perturbedIterations(
+              orbit, n, maxIterationCount, dcRe[k + lane], dcIm,
+              lanes[0][lane], lanes[1][lane], m[lane], i);
+        }
+        break;
+      }
+      dRe = _mm_load_pd(lanes[0]);
+      dIm = _mm_load_pd(lanes[1]);
+    }
+  }
+#endif
+  for (; k < count; ++k) {
+    out[k] = perturbedIterations(orbit, n, maxIterationCount, dcRe[k], dcIm);
+  }
+}
+
+/**
+ * The orbit Z_0 = 0, Z_k+1 = Z_k^2 + c of a reference point c, iterated in
+ * OrbitFloat and kept as doubles, against which the pixels of a deep view
+ * are iterated by perturbedIterations. The last point is also kept exactly,
+ * so a cached orbit can be extended to more iterations.
+ */
+template <typename T>
+class ReferenceOrbit {
+  T _re;
+  T _im;
+  vector<double> _points{0, 0};  // Z_0 to Z_n, real part first
+  OrbitFloat _lastRe = 0;
+  OrbitFloat _lastIm = 0;
+  bool _escaped = false;
+
+  static void appendDouble(vector<unsigned char> *out, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    appendLittleEndian(out, bits, 8);
+  }
+
+  static double readDouble(const unsigned char *in) {
+    const uint64_t bits = readLittleEndian(in, 8);
+    double value;
+    memcpy(&value, &bits, 8);
+    return value;
+  }
+
+  /**
+   * The orbit in the orbit file fileName, without its points unless
+   * withPoints, or null if it cannot be read or was computed in other
+   * arithmetic.
+   */
+  static unique_ptr<ReferenceOrbit> read(const string &fileName,
+                                         bool withPoints) {
+    const int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    unique_ptr<ReferenceOrbit> orbit;
+    unsigned char header[ORBIT_HEADER_SIZE];
+    struct stat status;
+    if (fstat(fd, &status) == 0 &&
+        pread(fd, header, sizeof header, 0) == sizeof header &&
+        memcmp(header, ORBIT_MAGIC, 8) == 0 &&
+        readLittleEndian(header + 8, 4) == ORBIT_VERSION &&
+        readLittleEndian(header + 12, 4) >= ORBIT_HEADER_SIZE &&
+        readLittleEndian(header + 16, 4) == ORBIT_DIGITS &&
+        readLittleEndian(header + 24, 8) < INT_MAX &&
+        readLittleEndian(header + 12, 4) +
+                16 * (readLittleEndian(header + 24, 8) + 1) ==
+            uint64_t(status.st_size)) {
+      const char *text = reinterpret_cast<const char *>(header + 80);
+      orbit.reset(new ReferenceOrbit(
+          strtold(string(text, strnlen(text, ORBIT_TEXT_SIZE)).c_str(),
+                  nullptr),
+          strtold(string(text + ORBIT_TEXT_SIZE,
+                         strnlen(text + ORBIT_TEXT_SIZE, ORBIT_TEXT_SIZE))
+                      .c_str(),
+                  nullptr)));
+      orbit->_escaped = readLittleEndian(header + 20, 4) != 0;
+      for (int part = 2; part >= 0; --part) {
+        orbit->_lastRe += readDouble(header + 32 + 8 * part);
+        orbit->_lastIm += readDouble(header + 56 + 8 * part);
+      }
+      const size_t headerSize = readLittleEndian(header + 12, 4);
+      const size_t n = readLittleEndian(header + 24, 8);
+      if (withPoints) {
+        vector<unsigned char> bytes(16 * (n + 1));
+        if (pread(fd, bytes.data(), bytes.size(), headerSize) ==
+            ssize_t(bytes.size())) {
+          orbit->_points.resize(2 * (n + 1));
+          for (size_t i = 0; i < orbit->_points.size(); ++i) {
+            orbit->_points[i] = readDouble(&bytes[8 * i]);
+          }
+        } else {
+          orbit.reset();
+        }
+      }
+    }
+    ::close(fd);
+    return orbit;
+  }
+
+ public:
+  ReferenceOrbit(T re, T im) : _re(re), _im(im) {}
+
+  int iterations() const { return _points.size() / 2 - 1; }
+
+  /** Whether the orbit holds every point maxIterationCount iterations use. */
+  bool covers(int maxIterationCount) const {
+    return _escaped || iterations() >= maxIterationCount;
+  }
+
+  /** Iterates the orbit on to maxIterationCount, or until it escapes. */
+  void extend(int maxIterationCount) {
+    const OrbitFloat cRe = _re;
+    const OrbitFloat cIm = _im;
+    OrbitFloat zRe = _lastRe;
+    OrbitFloat zIm = _lastIm;
+    OrbitFloat zRe2 = zRe * zRe;
+    OrbitFloat zIm2 = zIm * zIm;
+    for (int n = iterations(); n < maxIterationCount && !_escaped; ++n) {
+      zIm = 2 * zRe * zIm + cIm;
+      zRe = zRe2 - zIm2 + cRe;
+      zRe2 = zRe * zRe;
+      zIm2 = zIm * zIm;
+      _points.push_back(double(zRe));
+      _points.push_back(double(zIm));
+      _escaped = zRe2 + zIm2 > 4;
+    }
+    _lastRe = zRe;
+    _lastIm = zIm;
+  }
+
+  /** Whether the reference point lies within the view of params. */
+  bool within(const Params<T> &params) const {
+    const T height = params.width * params.HD_IMG_HEIGHT / params.HD_IMG_WIDTH;
+    return fabsl(_re - params.centerRe) <= params.width / 2 &&
+           fabsl(_im - params.centerIm) <= height / 2;
+  }
+
+  /**
+   * Iteration counts of pixels [x0,x1) of row iy of the view of params,
+   * which the orbit must cover, into out.
+   */
+  void iterationsRow(const Params<T> &params, int x0, int x1, int iy,
+                     int *out) const {
+    assert(x1 - x0 <= TILE_SIZE);
+    const T scale = params.width / params.HD_IMG_WIDTH;
+    const T offsetRe = params.centerRe - _re;
+    const double dcIm =
+        scale * (params.HD_IMG_HEIGHT / 2 - iy) + (params.centerIm - _im);
+    double dcRe[TILE_SIZE];
+    for (int ix = x0; ix < x1; ++ix) {
+      dcRe[ix - x0] = scale * (ix - params.HD_IMG_WIDTH / 2) + offsetRe;
+    }
+    perturbedRow(_points.data(), iterations(), params.maxIterationCount, dcRe,
+                 dcIm, x1 - x0, out);
+  }
+
+  /** Name of the file in dir for the orbit of this reference point. */
+  string fileName(const char *dir) const {
+    vector<unsigned char> key;
+    appendText(&key, _re, ORBIT_TEXT_SIZE);
+    appendText(&key, _im, ORBIT_TEXT_SIZE);
+    appendLittleEndian(&key, ORBIT_DIGITS, 4);
+    uint64_t hash = 14695981039346656037u;  // FNV-1a
+    for (const unsigned char byte : key) {
+      hash = (hash ^ byte) * 1099511628211u;
+    }
+    char name[32];
+    snprintf(name, sizeof name, "/%016llx.orbit",
+             static_cast<unsigned long long>(hash));
+    return dir + string(name);
+  }
+
+  /**
+   * The orbit cached in dir whose reference point lies within the view of
+   * params nearest its centre, or null if there is none. Its file is marked
+   * used, for trimOrbitCache.
+   */
+  static unique_ptr<ReferenceOrbit> findCached(const char *dir,
+                                               const Params<T> &params) {
+    const ReferenceOrbit centre(params.centerRe, params.centerIm);
+    const string exact = centre.fileName(dir);
+    unique_ptr<ReferenceOrbit> orbit = read(exact, true);
+    if (orbit) {
+      utimensat(AT_FDCWD, exact.c_str(), nullptr, 0);
+      return orbit;
+    }
+    DIR *entries = opendir(dir);
+    if (!entries) return nullptr;
+    string nearest;
+    T nearestDistance = 0;
+    while (const dirent *entry = readdir(entries)) {
+      const char *extension = strrchr(entry->d_name, '.');
+      if (!extension || strcmp(extension, ".orbit") != 0) continue;
+      const string fileName = dir + string("/") + entry->d_name;
+      orbit = read(fileName, false);
+      if (!orbit || !orbit->within(params)) continue;
+      const T distance = std::max(fabsl(orbit->_re - params.centerRe),
+                                  fabsl(orbit->_im - params.centerIm));
+      if (nearest.empty() || distance < nearestDistance) {
+        nearest = fileName;
+        nearestDistance = distance;
+      }
+    }
+    closedir(entries);
+    if (nearest.empty()) return nullptr;
+    orbit = read(nearest, true);
+    if (orbit) utimensat(AT_FDCWD, nearest.c_str(), nullptr, 0);
+    return orbit;
+  }
+
+  /**
+   * Writes the orbit as an orbit file to out. Errors are thrown as lodepng
+   * error codes.
+   */
+  void write(OutputFile *out) const {
+    vector<unsigned char> bytes(ORBIT_MAGIC, ORBIT_MAGIC + 8);
+    appendLittleEndian(&bytes, ORBIT_VERSION, 4);
+    appendLittleEndian(&bytes, ORBIT_HEADER_SIZE, 4);
+    appendLittleEndian(&bytes, ORBIT_DIGITS, 4);
+    appendLittleEndian(&bytes, _escaped, 4);
+    appendLittleEndian(&bytes, iterations(), 8);
+    for (OrbitFloat rest : {_lastRe, _lastIm}) {
+      for (int part = 0; part < 3; ++part) {
+        const double value = rest;
+        appendDouble(&bytes, value);
+        rest -= value;
+      }
+    }
+    appendText(&bytes, _re, ORBIT_TEXT_SIZE);
+    appendText(&bytes, _im, ORBIT_TEXT_SIZE);
+    bytes.resize(ORBIT_HEADER_SIZE);
+    out->write(bytes.data(), bytes.size());
+    for (size_t i = 0; i < _points.size(); i += 4096) {
+      bytes.clear();
+      for (size_t j = i; j < std::min(i + 4096, _points.size()); ++j) {
+        appendDouble(&bytes, _points[j]);
+      }
+      out->write(bytes.data(), bytes.size());
+    }
+  }
+};
+
+/**
+ * Sets *orbit to a reference orbit for the deep view of params that covers
+ * its maxIterationCount: *orbit itself if its reference point lies within
+ * the view, else the nearest one cached in params.orbitCacheDir, if set,
+ * that does, else a new one at the centre of the view. Orbits are computed
+ * or extended only as far as needed, and then saved to the cache, which is
+ * trimmed to its bounds. An orbit that cannot be cached is still used, with
+ * a warning.
+ */
+template <typename T>
+void prepareOrbit(const Params<T> &params,
+                  unique_ptr<ReferenceOrbit<T>> *orbit) {
+  if (!*orbit || !(*orbit)->within(params)) {
+    orbit->reset();
+    if (params.orbitCacheDir) {
+      *orbit = ReferenceOrbit<T>::findCached(params.orbitCacheDir, params);
+    }
+    if (!*orbit) {
+      orbit->reset(new ReferenceOrbit<T>(params.centerRe, params.centerIm));
+    }
+  }
+  if ((*orbit)->covers(params.maxIterationCount)) return;
+  const int cached = (*orbit)->iterations();
+  (*orbit)->extend(params.maxIterationCount);
+  cout << "Reference orbit iterations " << cached << " to "
+       << (*orbit)->iterations() << endl;
+  if (params.orbitCacheDir) {
+    mkdir(params.orbitCacheDir, 0777);  // if need be
+    try {
+      OutputFile out((*orbit)->fileName(params.orbitCacheDir).c_str());
+      (*orbit)->write(&out);
+      out.close();
+    } catch (unsigned err) {
+      cerr << "warning: reference orbit not cached in "
+           << params.orbitCacheDir << ": " << lodepng_error_text(err) << endl;
+      return;
+    }
+    trimOrbitCache(params.orbitCacheDir);
+  }
+}
+
+// Quantization of the colour model for palette output: entry 0 is the black
+// of the set, followed by HUE_LEVELS colours each at SHADE_LEVELS shades.
+constexpr int HUE_LEVELS = 63;
+constexpr int SHADE_LEVELS = 4;
+
+/**
+ * Full-value colour, scaled to 0..256, of a squared percentile on a ramp
+ * from hue through hueSpan more degrees.
+ */
+array<float, 3> fullColor(double hue, double hueSpan, double value) {
+  double h = fmod(hue + hueSpan * value, 360);
+  if (h < 0) h += 360;
+  const auto rgb = hsv2rgb(h, (1 - 3 * value / 4) / 2, 1);
+  return {float(rgb[0] * 256), float(rgb[1] * 256), float(rgb[2] * 256)};
+}
+
+/**
+ * Colour model, built once per render from the percentile table. Hue and
+ * saturation depend only on the iteration count and hsv2rgb is linear in the
+ * value channel, so each iteration count gets its full-value colour and a
+ * pixel is just that colour scaled by the shade-derived value.
+ */
+class ColorTable {
+  const Stats &_stats;
+  // Indexed by mapped iteration count, RGB scaled to 0..256 at full value.
+  // Points in the set (maxIterationCount) are left black.
+  PagedArray<array<float, 3>> _rgb;
+  // Likewise, the palette index of the darkest shade of the quantized colour,
+  // or 0 for points in the set.
+  PagedArray<unsigned char> _paletteBase;
+  // If the stats were only sampled, the counts they saw in order, so that
+  // other counts are coloured like the nearest one below them
+  vector<int> _seen;
+
+  /** The count whose colour iters gets. */
+  int seen(int iters) const {
+    if (_seen.empty()) return iters;
+    const auto above = std::upper_bound(_seen.begin(), _seen.end(), iters);
+    return above == _seen.begin() ? _seen.front() : above[-1];
+  }
+
+  static int shadeLevel(double shade) {
+    return std::min(int(shade * SHADE_LEVELS), SHADE_LEVELS - 1);
+  }
+
+ public:
+  /**
+   * Colours of the counts in stats, which if sampled are from a preview of
+   * the view that need not have every count of the image being coloured.
+   */
+  template <typename T>
+  ColorTable(const Stats &stats, const Params<T> &params, bool sampled = false)
+      : _stats(stats) {
+    stats.forEach([&](int iters, int) {
+      if (sampled) _seen.push_back(iters);
+      auto &entry = _rgb[stats.mapped(iters)];
+      auto &base = _paletteBase[stats.mapped(iters)];
+      if (iters == params.maxIterationCount) return;
+      double value = stats.percentile(iters);
+      value *= value;
+      entry = fullColor(params.hue, params.hueSpan, value);
+      const int hue = std::min(int(value * HUE_LEVELS), HUE_LEVELS - 1);
+      base = 1 + hue * SHADE_LEVELS;
+    });
+  }
+
+  /** Writes the three RGB bytes of the pixel colour to out. */
+  void rgb(int iters, double shade, unsigned char *out) const {
+    const auto &rgb = _rgb.at(_stats.mapped(seen(iters)));
+    const float value = (2 + shade) / 3;
+    out[0] = clamp(rgb[0] * value);
+    out[1] = clamp(rgb[1] * value);
+    out[2] = clamp(rgb[2] * value);
+  }
+
+  /** Index into palette() of the pixel colour. */
+  unsigned char paletteIndex(int iters, double shade) const {
+    const unsigned char base = _paletteBase.at(_stats.mapped(seen(iters)));
+    return base == 0 ? 0 : base + shadeLevel(shade);
+  }
+
+  /**
+   * Colours at the centre of each hue and shade quantization step of the
+   * colour ramp of params.
+   */
+  template <typename T>
+  static vector<array<unsigned char, 3>> palette(const Params<T> &params) {
+    vector<array<unsigned char, 3>> result(1 + HUE_LEVELS * SHADE_LEVELS);
+    for (int hue = 0; hue < HUE_LEVELS; ++hue) {
+      const auto rgb =
+          fullColor(params.hue, params.hueSpan, (hue + 0.5) / HUE_LEVELS);
+      for (int level = 0; level < SHADE_LEVELS; ++level) {
+        const float value = (2 + (level + 0.5) / SHADE_LEVELS) / 3;
+        auto &entry = result[1 + hue * SHADE_LEVELS + level];
+        for (int i = 0; i < 3; ++i) {
+          entry[i] = clamp(rgb[i] * value);
+        }
+      }
+    }
+    return result;
+  }
+};
+
+/** Hands out tiles to worker threads in row-major tile order. */
+class TileQueue {
+  const int _width;
+  const int _height;
+  const int _across;
+  const int _count;
+  atomic<int> _next{0};
+
+ public:
+  TileQueue(int width, int height)
+      : _width(width),
+        _height(height),
+        _across((width + TILE_SIZE - 1) / TILE_SIZE),
+        _count(_across * ((height + TILE_SIZE - 1) / TILE_SIZE)) {}
+
+  /** Claims the next tile [x0,x1)x[y0,y1), returning false when none remain. */
+  bool next(int *x0, int *y0, int *x1, int *y1) {
+    const int tile = _next++;
+    if (tile >= _count) return false;
+    *x0 = (tile % _across) * TILE_SIZE;
+    *y0 = (tile / _across) * TILE_SIZE;
+    *x1 = std::min(*x0 + TILE_SIZE, _width);
+    *y1 = std::min(*y0 + TILE_SIZE, _height);
+    return true;
+  }
+};
+
+/**
+ * Phase one: escape-time computation, by perturbation if given a reference
+ * orbit, accumulating this thread's stats unless stats is null, as for the
+ * bands of a Deep Zoom image. The rows of img are those of the view from
+ * firstRow down.
+ */
+template <typename T>
+void computeWorker(const Params<T> &params, const ReferenceOrbit<T> *orbit,
+                   int firstRow, Image *img, TileQueue *tiles, Stats *stats,
+                   int mod) {
+  int x0, y0, x1, y1;
+  while (tiles->next(&x0, &y0, &x1, &y1)) {
+    for (int iy = y0; iy < y1; ++iy) {
+      int *span = img->writableIterationsSpan(x0, iy);
+      if (orbit) {
+        orbit->iterationsRow(params, x0, x1, firstRow + iy, span);
+      } else {
+        for (int ix = x0; ix < x1; ++ix) {
+          span[ix - x0] = iterations(params, ix, firstRow + iy);
+        }
+      }
+      if (!stats) continue;
+      for (int k = 0; k < x1 - x0; ++k) {
+        if (span[k] != params.maxIterationCount) {
+          (*stats)(span[k]);
+        }
+      }
+    }
+  }
+  if (stats) cout << "Finished thread " << mod << endl;
+}
+
+/**
+ * Phase one of a recolouring, with the counts already in img: just
+ * accumulating this thread's stats.
+ */
+void countWorker(int maxIterationCount, const Image *img, TileQueue *tiles,
+                 Stats *stats) {
+  int x0, y0, x1, y1;
+  while (tiles->next(&x0, &y0, &x1, &y1)) {
+    for (int iy = y0; iy < y1; ++iy) {
+      const int *span = img->iterationsSpan(x0, iy);
+      for (int k = 0; k < x1 - x0; ++k) {
+        if (span[k] != maxIterationCount) {
+          (*stats)(span[k]);
+        }
+      }
+    }
+  }
+}
+
+/** Phase two: once the global percentiles are known, shade and colour. */
+void colorWorker(const ColorTable &colors, const Shading &shading,
+                 bool palette, Image *img, TileQueue *tiles,
+                 TileRowProgress *progress) {
+  double shade[TILE_SIZE * TILE_SIZE];
+  unsigned char pixels[TILE_SIZE * 3];
+  int x0, y0, x1, y1;
+  while (tiles->next(&x0, &y0, &x1, &y1)) {
+    img->hillshade(x0, y0, x1, y1, shading, shade);
+    for (int iy = y0; iy < y1; ++iy) {
+      const int *iters = img->iterationsSpan(x0, iy);
+      const double *rowShade = shade + (iy - y0) * TILE_SIZE;
+      if (palette) {
+        for (int k = 0; k < x1 - x0; ++k) {
+          pixels[k] = colors.paletteIndex(iters[k], rowShade[k]);
+        }
+      } else {
+        for (int k = 0; k < x1 - x0; ++k) {
+          colors.rgb(iters[k], rowShade[k], pixels + k * 3);
+        }
+      }
+      img->setPixels(x0, iy, pixels, x1 - x0);
+    }
+    progress->tileDone(y0);
+  }
+}
+
+/**
+ * Phase one of rendering the view described by params into img: computes
+ * the counts, by perturbation against orbit if not null, or if recolor takes
+ * those already in img. Returns their statistics, ready for colouring.
+ */
+template <typename T>
+Stats computeFrame(const Params<T> &params, const ReferenceOrbit<T> *orbit,
+                   Image *img, bool recolor) {
+  vector<Stats> threadStats(threadCount);
+  {
+    TileQueue tiles(img->width(), img->height());
+    vector<thread> threads;
+    for (int mod = 0; mod < threadCount; ++mod) {
+      if (recolor) {
+        threads.emplace_back(countWorker, params.maxIterationCount, img,
+                             &tiles, &threadStats[mod]);
+      } else {
+        threads.emplace_back(computeWorker<T>, std::cref(params), orbit, 0,
+                             img, &tiles, &threadStats[mod], mod);
+      }
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+  Stats stats;
+  for (const auto &s : threadStats) {
+    stats += s;
+  }
+  stats(params.maxIterationCount);
+  stats.preparePercentile();
+  return stats;
+}
+
+/**
+ * Phase one for a band of a larger image, coloured by the statistics of
+ * another: computes the counts of the rows of the view from firstRow down
+ * into img, by perturbation against orbit if not null, without statistics.
+ */
+template <typename T>
+void computeBand(const Params<T> &params, const ReferenceOrbit<T> *orbit,
+                 Image *img, int firstRow) {
+  TileQueue tiles(img->width(), img->height());
+  vector<thread> threads;
+  for (int mod = 0; mod < threadCount; ++mod) {
+    threads.emplace_back(computeWorker<T>, std::cref(params), orbit, firstRow,
+                         img, &tiles, nullptr, mod);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+/**
+ * Phase two: shades img as params describes and colours it with colors.
+ * Meanwhile encode(progress) is called on this thread to encode rows as
+ * progress reports them coloured.
+ */
+template <typename T, typename F>
+void colorFrame(const Params<T> &params, const ColorTable &colors, Image *img,
+                F encode) {
+  const Shading shading(params.altitude, params.azimuth, params.zFactor);
+  TileQueue tiles(img->width(), img->height());
+  TileRowProgress progress(img->width(), img->height());
+  vector<thread> threads;
+  for (int mod = 0; mod < threadCount; ++mod) {
+    threads.emplace_back(colorWorker, std::cref(colors), std::cref(shading),
+                         params.palette, img, &tiles, &progress);
+  }
+  try {
+    encode(&progress);
+  } catch (...) {
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    throw;
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+/**
+ * Renders the view described by params into img, by perturbation against
+ * orbit if not null, or if recolor just colours the counts already in it.
+ * Once the colouring starts, encode(progress) is called on this thread to
+ * encode rows as progress reports them coloured. Returns the iteration
+ * statistics of the view.
+ */
+template <typename T, typename F>
+Stats renderFrame(const Params<T> &params, const ReferenceOrbit<T> *orbit,
+                  Image *img, bool recolor, F encode) {
+  // The percentile table is the only global dependency between pixels, so
+  // the pipeline runs as two tiled phases separated by its construction.
+  Stats stats = computeFrame(params, orbit, img, recolor);
+  colorFrame(params, ColorTable(stats, params), img, encode);
+  return stats;
+}
+
+// Most pixels of the preview that the colours of a Deep Zoom image are
+// taken from
+constexpr size_t STATS_SAMPLE_PIXELS = 1 << 22;
+
+/**
+ * Renders the view described by params as a Deep Zoom image, a band of
+ * DZI_TILE_SIZE rows at a time (plus a row above and below for the
+ * hill-shading), so that even a view of billions of pixels needs memory for
+ * only a few rows of tiles. As the percentiles cannot wait for the whole
+ * image, they come from a preview of at most STATS_SAMPLE_PIXELS, which is
+ * the image itself if it is no bigger. Returns the statistics of the
+ * preview. Errors are thrown as lodepng error codes.
+ */
+template <typename T>
+Stats renderDzi(const Params<T> &params) {
+  unique_ptr<ReferenceOrbit<T>> orbit;
+  if (isDeep(params)) prepareOrbit(params, &orbit);
+
+  int shrink = 1;
+  while (size_t(params.HD_IMG_WIDTH / shrink) *
+             (params.HD_IMG_HEIGHT / shrink) >
+         STATS_SAMPLE_PIXELS) {
+    ++shrink;
+  }
+  Params<T> preview = params;
+  preview.HD_IMG_WIDTH = std::max(params.HD_IMG_WIDTH / shrink, 1);
+  preview.HD_IMG_HEIGHT = std::max(params.HD_IMG_HEIGHT / shrink, 1);
+  Stats stats;
+  {
+    Image sample(preview.HD_IMG_WIDTH, preview.HD_IMG_HEIGHT, Layout::ROWS,
+                 3);
+    stats = computeFrame(preview, orbit.get(), &sample, false);
+  }
+  const ColorTable colors(stats, params, shrink > 1);
+
+  DziWriter dzi(params.outputFileName, params.HD_IMG_WIDTH,
+                params.HD_IMG_HEIGHT, params.compression);
+  for (int y0 = 0; y0 < params.HD_IMG_HEIGHT; y0 += DZI_TILE_SIZE) {
+    const int y1 = std::min(y0 + DZI_TILE_SIZE, params.HD_IMG_HEIGHT);
+    const int top = std::max(y0 - 1, 0);
+    const int bottom = std::min(y1 + 1, params.HD_IMG_HEIGHT);
+    Image band(params.HD_IMG_WIDTH, bottom - top, Layout::ROWS, 3);
+    computeBand(params, orbit.get(), &band, top);
+    colorFrame(params, colors, &band, [&](TileRowProgress *progress) {
+      band.forEachBatch(progress, bottom - top,
+                        [&](const unsigned char *rows, int) {
+                          dzi.addRows(rows + size_t(params.HD_IMG_WIDTH) *
+                                                 (y0 - top) * 3,
+                                      y1 - y0);
+                        });
+    });
+  }
+  cout << "Finished " << (params.HD_IMG_HEIGHT + DZI_TILE_SIZE - 1) /
+                             DZI_TILE_SIZE
+       << " bands of " << DZI_TILE_SIZE << " rows" << endl;
+  dzi.finish();
+  return stats;
+}
+
+void writeHistogram(const Stats &stats) {
+  ofstream histogram("histogram.csv");
+  histogram << stats;
+  histogram.close();
+}
+
+}  // namespace
+
+int main(int argc, char *const argv[]) {
+  Params<long double> params;
+  Layout layout = Layout::ROWS;
+  vector<long double> widths = {params.width};  // one frame per width
+  bool formatGiven = false;
+
+  auto usage = [&] {
+    cerr << "Usage: " << argv[0]
+         << " -W HD_IMG_WIDTH -H HD_IMG_HEIGHT -x centerReal -y "
+            "centerImaginary "
+            "-w "
+            "viewportWidth[,viewportWidth...] -i iterations -L rows|tiles "
+            "-c fast|balanced|max [-p] -f png|qoi|jpg|y4m|rgb|gif|apng|dzi "
+            "(default from the -o extension; -o - for stdout; several "
+            "widths only for y4m, rgb, gif and apng; dzi writes PNG tiles "
+            "to name_files/ for -o name.dzi) [-b] (gif or apng "
+            "frames forwards then backwards) [-D file.iter|file.iterz] "
+            "(also save the iteration counts of a single image, "
+            "compressed for .iterz) [-R file.iter|file.iterz] (colour "
+            "saved iteration counts, taking the view from the file) "
+            "-s altitude[,azimuth[,zFactor]] (hill-shading light in "
+            "degrees) -u hue[,hueSpan] (colour ramp in degrees) [-O dir] "
+            "(cache reference orbits of deep views in dir)"
+         << endl
+         << "  defaults:  -W 1400 -H 900  -x -0.5671 -y -0.56698 -w 0.2 "
+            "-i "
+            "10000 -o mandelbrot.png -L rows -c balanced -s 45,135,1 "
+            "-u 0,250"
+         << endl;
+    return EXIT_FAILURE;
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "W:H:x:y:w:i:o:L:c:pf:bD:R:s:u:O:")) != -1) {
+    switch (opt) {
+      case 'W':
+        params.HD_IMG_WIDTH = atoi(optarg);
+        break;
+      case 'H':
+        params.HD_IMG_HEIGHT = atoi(optarg);
+        break;
+      case 'x':
+        params.centerRe = strtold(optarg, NULL);
+        break;
+      case 'y':
+        params.centerIm = strtold(optarg, NULL);
+        break;
+      case 'w':
+        widths.clear();
+        for (const char *width = optarg;; ++width) {
+          char *end;
+          widths.push_back(strtold(width, &end));
+          if (*end != ',') break;
+          width = end;
+        }
+        break;
+      case 'i':
+        params.maxIterationCount = atoi(optarg);
+        break;
+      case 'o':
+        params.outputFileName = optarg;
+        break;
+      case 'L':
+        if (strcmp(optarg, "tiles") == 0) {
+          layout = Layout::TILES;
+        } else if (strcmp(optarg, "rows") == 0) {
+          layout = Layout::ROWS;
+        } else {
+          return usage();
+        }
+        break;
+      case 'c':
+        if (strcmp(optarg, "fast") == 0) {
+          params.compression = Compression::FAST;
+        } else if (strcmp(optarg, "balanced") == 0) {
+          params.compression = Compression::BALANCED;
+        } else if (strcmp(optarg, "max") == 0) {
+          params.compression = Compression::MAX;
+        } else {
+          return usage();
+        }
+        break;
+      case 'p':
+        params.palette = true;
+        break;
+      case 'f':
+        if (!parseFormat(optarg, &params.format)) return usage();
+        formatGiven = true;
+        break;
+      case 'b':
+        params.bounce = true;
+        break;
+      case 'D':
+        params.iterationsFileName = optarg;
+        break;
+      case 'R':
+        params.recolorFileName = optarg;
+        break;
+      case 'O':
+        params.orbitCacheDir = optarg;
+        break;
+      case 's':
+        if (!parseNumbers(optarg, {&params.altitude, &params.azimuth,
+                                   &params.zFactor})) {
+          return usage();
+        }
+        break;
+      case 'u':
+        if (!parseNumbers(optarg, {&params.hue, &params.hueSpan})) {
+          return usage();
+        }
+        break;
+      default: /* '?' */
+        return usage();
+    }
+  }
+
+  // Colouring saved counts replaces the view with the file's, so it is done
+  // before checking the view
+  unique_ptr<IterationsFile> saved;
+  if (params.recolorFileName) {
+    if (widths.size() > 1) return usage();
+    try {
+      saved.reset(new IterationsFile(params.recolorFileName));
+    } catch (const std::runtime_error &e) {
+      cerr << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+    saved->getParams(&params);
+    widths = {params.width};
+  }
+
+  if (!formatGiven) params.format = formatOf(params.outputFileName);
+  if (widths.size() > 1 && !isSequence(params.format)) return usage();
+  if (widths.size() > 1 && params.iterationsFileName) return usage();
+  if (params.bounce && params.format != Format::GIF &&
+      params.format != Format::APNG) {
+    return usage();
+  }
+  // JPEG headers hold 16-bit dimensions
+  if (params.format == Format::JPEG &&
+      (params.HD_IMG_WIDTH > 65535 || params.HD_IMG_HEIGHT > 65535)) {
+    return usage();
+  }
+  // Deep Zoom images are only ever whole in their files
+  if (params.format == Format::DZI &&
+      (params.palette || strcmp(params.outputFileName, "-") == 0 ||
+       params.iterationsFileName || saved)) {
+    return usage();
+  }
+  // GIF frames are written in palette indices
+  if (params.format == Format::GIF) params.palette = true;
+  // With the image going to stdout, progress messages go to stderr
+  if (strcmp(params.outputFileName, "-") == 0) cout.rdbuf(cerr.rdbuf());
+
+  Stats stats;
+  if (params.format == Format::DZI) {
+    params.width = widths.front();
+    try {
+      stats = renderDzi(params);
+    } catch (unsigned err) {
+      cerr << "encoder error " << err << ": " << lodepng_error_text(err)
+           << endl;
+      return EXIT_FAILURE;
+    }
+    writeHistogram(stats);
+    return 0;
+  }
+
+  const int channels = params.palette ? 1 : 3;
+  const unique_ptr<Image> image(
+      saved ? new Image(params.HD_IMG_WIDTH, params.HD_IMG_HEIGHT,
+                        saved->iterations(), channels)
+            : new Image(params.HD_IMG_WIDTH, params.HD_IMG_HEIGHT, layout,
+                        channels));
+  Image &img = *image;
+  vector<array<unsigned char, 3>> palette;
+  if (params.palette) palette = ColorTable::palette(params);
+
+  try {
+    OutputFile out(params.outputFileName);
+    unique_ptr<VideoStream> video;
+    if (params.format == Format::Y4M || params.format == Format::RGB) {
+      video.reset(new VideoStream(&out, params.HD_IMG_WIDTH,
+                                  params.HD_IMG_HEIGHT,
+                                  params.format == Format::Y4M));
+    }
+    unique_ptr<GifStream> gif;
+    if (params.format == Format::GIF) {
+      gif.reset(new GifStream(&out, params.HD_IMG_WIDTH, params.HD_IMG_HEIGHT,
+                              palette, params.bounce));
+    }
+    lodepng::State apngState;
+    unique_ptr<PngStream> apng;
+    if (params.format == Format::APNG) {
+      params.width = widths.front();  // for the description
+      initPngState(params, palette, &apngState);
+      apng.reset(new PngStream(&out, apngState, params.HD_IMG_WIDTH,
+                               params.HD_IMG_HEIGHT, widths.size(),
+                               params.bounce));
+    }
+    unique_ptr<ReferenceOrbit<long double>> orbit;
+    for (const long double width : widths) {
+      params.width = width;
+      const bool deep = !saved && isDeep(params);
+      if (deep) prepareOrbit(params, &orbit);
+      stats = renderFrame(
+          params, deep ? orbit.get() : nullptr, &img, saved != nullptr,
+          [&](TileRowProgress *progress) {
+            switch (params.format) {
+              case Format::PNG:
+                img.writePng(params, palette, progress, &out);
+                break;
+              case Format::QOI:
+                img.writeQoi(palette, progress, &out);
+                break;
+              case Format::JPEG:
+                img.writeJpeg(palette, progress, &out);
+                break;
+              case Format::Y4M:
+              case Format::RGB:
+                img.writeFrame(palette, progress, video.get());
+                break;
+              case Format::GIF:
+                img.writeFrame(progress, gif.get());
+                break;
+              case Format::APNG:
+                img.writeFrame(progress, apng.get());
+                break;
+              case Format::DZI:  // rendered by renderDzi instead
+                break;
+            }
+          });
+#ifndef LODEPNG_COMPILE_ALLOCATORS
+      cout << "lodepng allocations: " << lodepngAllocations.exchange(0)
+           << endl;
+#endif
+    }
+    if (gif) gif->finish();
+    if (apng) apng->finish();
+    out.close();
+    if (params.iterationsFileName) {
+      OutputFile iterationsOut(params.iterationsFileName);
+      writeIterations(params, img,
+                      iterationsEncodingOf(params.iterationsFileName),
+                      &iterationsOut);
+      iterationsOut.close();
+    }
+  } catch (unsigned err) {
+    cerr << "encoder error " << err << ": " << lodepng_error_text(err) << endl;
+    return EXIT_FAILURE;
+  }
 
-  return ok ? 0 : 1;
+  writeHistogram(stats);
+  return 0;
 }
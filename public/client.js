@@ -8,6 +8,7 @@
  mp4Element,
  hdMp4Element,
  mediumElement,
+ hdElement,
  xElement,
  yElement,
  wElement,
@@ -47,11 +48,23 @@ const doit = () => {
   mp4Element.setAttribute('href', `/mp4?x=${x}&y=${y}&w=${w}&i=${i}`)
   hdMp4Element.setAttribute('href', `/hd-mp4?x=${x}&y=${y}&w=${w}&i=${i}`)
   mediumElement.setAttribute('href', `/medium?x=${x}&y=${y}&w=${w}&i=${i}`)
+  hdElement.setAttribute('href', `/hd?x=${x}&y=${y}&w=${w}&i=${i}`)
   imgElement.className = 'cursor-busy'
-  imgElement.setAttribute('src', `/hd?x=${x}&y=${y}&w=${w}&i=${i}`)
+  // The quick JPEG preview first, then the lossless PNG in its place once
+  // that has loaded too, unless the view has moved on by then
+  const view = window.location.hash
+  imgElement.setAttribute('src', `/preview?x=${x}&y=${y}&w=${w}&i=${i}`)
   imgElement.onload = () => {
     setCursorMagnification()
     busy = false
+    imgElement.onload = null
+    const lossless = new Image()
+    lossless.onload = () => {
+      if (window.location.hash === view) {
+        imgElement.setAttribute('src', lossless.src)
+      }
+    }
+    lossless.src = `/hd?x=${x}&y=${y}&w=${w}&i=${i}`
   }
   imgElement.onclick = event => {
     if (busy) {
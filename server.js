@@ -1,5 +1,6 @@
 import express from 'express'
-import { promises, existsSync } from 'fs'
+import { existsSync } from 'fs'
+import { rename, rm } from 'fs/promises'
 import { spawn } from 'child_process'
 import {
   HD_IMG_WIDTH, HD_IMG_HEIGHT,
@@ -7,8 +8,6 @@ import {
   VIDEO_WIDTH, VIDEO_HEIGHT
 } from './public/common.js'
 
-const { writeFile } = promises
-
 const app = express()
 const port = 3333
 
@@ -19,6 +18,9 @@ if (process.argv.length !== 3) {
 }
 const executable = process.argv[2]
 
+// Reference orbits of deep views, shared by all renders near the same point
+const orbitCacheDir = 'orbits'
+
 app.use(express.static('public'))
 
 const execute = (command, args) => new Promise((resolve, reject) => {
@@ -43,9 +45,83 @@ const execute = (command, args) => new Promise((resolve, reject) => {
   })
 })
 
-const imgEndPoint = (imgWidth, imgHeight) => async (req, res) => {
+// Runs producer with its stdout piped into consumer, each given as
+// [command, args], resolving once both have exited successfully. Either
+// failing to start, exiting with an error or being killed by a signal
+// rejects, and a consumer that exits early is not fed any further.
+const pipe = (producer, consumer) => new Promise((resolve, reject) => {
+  console.log('+', producer[0], producer[1].join(' '), '|', consumer[0], consumer[1].join(' '))
+  const from = spawn(...producer)
+  const to = spawn(...consumer)
+  from.stdout.pipe(to.stdin)
+
+  let failure = null
+  const fail = error => {
+    if (failure === null) {
+      failure = error
+    }
+  }
+  // EPIPE once the consumer has gone; its own exit status says why
+  to.stdin.on('error', error => {
+    console.log(`stdin: ${error}`)
+    from.stdout.unpipe(to.stdin)
+    from.kill()
+  })
+
+  for (const child of [from, to]) {
+    child.stderr.on('data', data => {
+      console.log(`stderr: ${data}`)
+    })
+  }
+  to.stdout.on('data', data => {
+    console.log(`stdout: ${data}`)
+  })
+
+  let running = 2
+  for (const child of [from, to]) {
+    const other = child === from ? to : from
+    // Failing to start at all, when close may never come
+    child.on('error', error => {
+      console.log(`child process error ${error}`)
+      other.kill()
+      reject(error)
+    })
+    child.on('close', (code, signal) => {
+      console.log(`child process exited with code ${code} signal ${signal}`)
+      if (code !== 0 || signal) {
+        fail(code || signal || 'failed')
+      }
+      if (--running === 0) {
+        if (failure !== null) {
+          reject(failure)
+        } else {
+          resolve()
+        }
+      }
+    })
+  }
+})
+
+// Renders in progress by file name, so that a request for a file that is
+// still being made waits for it rather than making it again. The renderer
+// only puts a file in place once it is complete, so until then it does not
+// exist.
+const rendering = new Map()
+
+const renderOnce = (fileName, render) => {
+  if (!rendering.has(fileName)) {
+    rendering.set(fileName, render().finally(() => rendering.delete(fileName)))
+  }
+  return rendering.get(fileName)
+}
+
+// The format follows from the suffix of the file name: PNG, or JPEG for
+// previews that are much smaller to transfer. A PNG is only palette-indexed,
+// smaller but lossy, if asked for with palette=1.
+const imgEndPoint = (imgWidth, imgHeight, suffix = 'png') => async (req, res) => {
   const { x, y, w, i } = req.query
-  const imgPath = `/cache/${imgWidth}x${imgHeight}_${x}_${y}_${w}_${i}.png`
+  const palette = suffix === 'png' && req.query.palette === '1'
+  const imgPath = `/cache/${palette ? 'palette-' : ''}${imgWidth}x${imgHeight}_${x}_${y}_${w}_${i}.${suffix}`
   const imgFileName = `public${imgPath}`
 
   if (existsSync(imgFileName)) {
@@ -54,15 +130,17 @@ const imgEndPoint = (imgWidth, imgHeight) => async (req, res) => {
     return
   }
   console.log('Generating ', imgFileName)
-  await execute(executable, [
+  await renderOnce(imgFileName, () => execute(executable, [
     '-o', imgFileName,
     '-x', x,
     '-y', y,
     '-w', w,
     '-i', i,
     '-W', imgWidth,
-    '-H', imgHeight
-  ])
+    '-H', imgHeight,
+    '-O', orbitCacheDir,
+    ...(palette ? ['-p'] : [])
+  ]))
   console.log('Generated ', imgFileName)
   res.redirect(imgPath)
 }
@@ -72,7 +150,6 @@ const videoEndPoint = (suffix, imgWidth, imgHeight, fast = true) => async (req,
   const { x, y, w, i } = req.query
   const videoPath = `/cache/${fast ? '' : 'slow-'}${imgWidth}x${imgHeight}_${x}_${y}_${w}_${i}.${suffix}`
   const videoFileName = `public${videoPath}`
-  const inputImagesPath = `public/cache/${imgWidth}x${imgHeight}_${x}_${y}_${w}_${i}.txt`
 
   if (existsSync(videoFileName)) {
     console.log('Using existing cached ', videoFileName)
@@ -95,71 +172,76 @@ const videoEndPoint = (suffix, imgWidth, imgHeight, fast = true) => async (req,
   }
   videoWs.reverse()
 
-  const videoImgFilenameF = frame =>
-    `public/cache/${imgWidth}x${imgHeight}_${x}_${y}_${w}_${i}_${frame}.png`
-
-  let inputImages = ''
-  let frame = 0
-  const frames = []
-  for (const videoW of videoWs) {
-    ++frame
-    frames.push(frame)
-    const videoImgFilename = videoImgFilenameF(frame)
-    inputImages += `file '${videoImgFilename}'\n`
-    if (existsSync(videoImgFilename)) {
-      console.log('Using existing cached ', videoImgFilename)
-    } else {
-      console.log('Generating ', videoImgFilename)
-      await execute('./mandelbrot', [
-        '-o', videoImgFilename,
-        '-x', x,
-        '-y', y,
-        '-w', videoW,
-        '-i', i,
-        '-W', imgWidth,
-        '-H', imgHeight
-      ])
-
-      console.log('Generated ', videoImgFilename)
+  if (suffix === 'mp4') {
+    // All the frames are rendered by one process and streamed straight into
+    // ffmpeg as YUV4MPEG2, with no image files in between. ffmpeg writes to
+    // another name, renamed once the video is complete.
+    const partFileName = `${videoFileName}.part`
+    try {
+      await renderOnce(videoFileName, async () => {
+        try {
+          await pipe(['./mandelbrot', [
+            '-o', '-',
+            '-f', 'y4m',
+            '-x', x,
+            '-y', y,
+            '-w', videoWs.join(','),
+            '-i', i,
+            '-W', imgWidth,
+            '-H', imgHeight,
+            '-O', orbitCacheDir
+          ]], ['ffmpeg', [
+            '-f', 'yuv4mpegpipe',
+            '-i', '-',
+            '-codec:v', 'libx264',
+            '-profile:v', 'high',
+            '-preset', 'slow',
+            '-pix_fmt', 'yuv420p',
+            '-crf', 17,
+            '-an',
+            '-f', 'mp4',
+            '-y', partFileName
+          ]])
+        } catch (error) {
+          await rm(partFileName, { force: true })
+          throw error
+        }
+        await rename(partFileName, videoFileName)
+      })
+    } catch (error) {
+      console.log(`video failed: ${error}`)
+      res.sendStatus(500)
+      return
     }
+    res.redirect(videoPath)
+    return
   }
-  await writeFile(inputImagesPath, inputImages)
-
-  const inAndOut = [
-    ...frames.sort((a, b) => a - b),
-    ...frames.sort((a, b) => b - a)
-  ]
-  switch (suffix) {
-    case 'gif':
-      await execute('convert', [
-        '-delay', 4,
-        '-colors', 200,
-        ...inAndOut.map(videoImgFilenameF),
-        '-loop', 0,
-        videoFileName
-      ])
-      break
-    case 'mp4':
-      await execute('ffmpeg', [
-        '-r:v', 30,
-        '-i', videoImgFilenameF('%d'),
-        '-codec:v', 'libx264',
-        '-profile:v', 'high',
-        '-preset', 'slow',
-        '-pix_fmt', 'yuv420p',
-        '-crf', 17,
-        '-an', videoFileName])
-      break
-  }
+
+  // GIFs and APNGs are written directly, zooming in and back out again, with
+  // the fixed palette of the colour model rather than one quantized from PNGs.
+  await renderOnce(videoFileName, () => execute('./mandelbrot', [
+    '-o', videoFileName,
+    '-b',
+    '-p',
+    '-x', x,
+    '-y', y,
+    '-w', videoWs.join(','),
+    '-i', i,
+    '-W', imgWidth,
+    '-H', imgHeight,
+    '-O', orbitCacheDir
+  ]))
   res.redirect(videoPath)
 }
 
 app.get('/gif', videoEndPoint('gif', VIDEO_WIDTH / 5, VIDEO_HEIGHT / 5))
+app.get('/apng', videoEndPoint('apng', VIDEO_WIDTH / 5, VIDEO_HEIGHT / 5))
 app.get('/zoom', videoEndPoint('mp4', VIDEO_WIDTH / 5, VIDEO_HEIGHT / 5))
 app.get('/slow-zoom', videoEndPoint('mp4', VIDEO_WIDTH / 5, VIDEO_HEIGHT / 5, /* fast= */ false))
 app.get('/mp4', videoEndPoint('mp4', VIDEO_WIDTH, VIDEO_HEIGHT))
 app.get('/hd-mp4', videoEndPoint('mp4', HD_IMG_WIDTH, HD_IMG_HEIGHT, /* fast= */ false))
 app.get('/hd', imgEndPoint(HD_IMG_WIDTH, HD_IMG_HEIGHT))
+app.get('/preview', imgEndPoint(HD_IMG_WIDTH, HD_IMG_HEIGHT, 'jpg'))
 app.get('/medium', imgEndPoint(MEDIUM_IMG_WIDTH, MEDIUM_IMG_HEIGHT))
 
 app.listen(port, () => {